@@ -133,6 +133,16 @@
  */
 #define TRY_DENSE_HEAP_START (void *) 0x800000000
 
+/*
+ * Commit dense heap memory on demand in steps of MEM_COMMIT_STEP bytes,
+ *  and decommit it when the heap shrinks or is reset.  When 0, the whole
+ *  reservation is accessible from the start
+ */
+#ifndef MEM_LAZY_COMMIT
+#define MEM_LAZY_COMMIT 0
+#endif
+#define MEM_COMMIT_STEP (1<<16)
+
 
 /*********** Parameters controlling sparse memory version of heap ***********/
 
@@ -21,6 +21,10 @@
 #include <stdbool.h>
 #include <math.h>
 
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
+
 #include "mm.h"
 #include "memlib.h"
 #include "fcyc.h"
@@ -80,9 +84,10 @@ typedef struct {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
+    enum { ALLOC, FREE, REALLOC, CALLOC, MEMALIGN } type; /* type of request */
     long index;                         /* index for free() to use later */
-    size_t size;                        /* byte size of alloc/realloc request */
+    size_t size;                        /* byte size of alloc/realloc/calloc request */
+    size_t align;                       /* payload alignment of a memalign request */
 } traceop_t;
 
 /* Holds the information for one trace file */
@@ -96,6 +101,7 @@ typedef struct {
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     int *block_rand_base; /* index into random_data, if debug is on */
+    char **batch;         /* pointers of the requests of a batch */
 } trace_t;
 
 /*
@@ -108,12 +114,33 @@ typedef struct {
     range_set_t *ranges;
 } speed_t;
 
+#ifdef THREAD_SAFE
+/* Payload held by one thread in each heap region, kept on its stack */
+typedef struct {
+    size_t live[MEM_MAX_REGIONS]; /* payload bytes currently allocated */
+    size_t peak[MEM_MAX_REGIONS]; /* ... and their maximum */
+} mt_payload_t;
+
+/* Per-thread state of a multithreaded trace replay */
+typedef struct {
+    const trace_t *trace;
+    char **blocks;            /* private array of ptrs returned by malloc */
+    size_t *sizes;            /* ... and their payload sizes */
+    signed char *regions;     /* ... and their heap regions, -1 if mapped */
+    size_t peak[MEM_MAX_REGIONS]; /* peak payload of the thread per region */
+    pthread_barrier_t *start; /* released once all threads are ready */
+    struct timespec begin;    /* when the thread started replaying */
+    struct timespec end;      /* when the thread finished replaying */
+} mt_replay_t;
+#endif
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
     char     filename[MAXLINE];
     weight_t weight;
     double   ops;      /* number of ops (malloc/free/realloc) in the trace */
+    size_t   reallocs; /* number of realloc ops in the trace */
 
     /* run-time stats defined for both libc and student */
     bool valid;        /* was the trace processed correctly by the allocator? */
@@ -122,6 +149,12 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;       /* space utilization for this trace (always 0 for libc) */
+    size_t heap_final; /* heap size at the end of the trace */
+    size_t heap_peak;  /* largest heap size during the trace */
+    size_t sbrks;      /* number of heap extensions during the trace */
+    size_t expanded;   /* reallocs avoided by growing in place (-E) */
+    struct mm_stats heap_stats; /* heap snapshot at the payload peak (-F) */
+    struct mm_instrument counters; /* hot path counters of the trace (-I) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -161,6 +194,13 @@ int verbose = REF_ONLY ? 0 : 1;  /* global flag for verbose output */
 static int errors = 0;           /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false;     /* Print output as tab-separated fields */
+static bool calloc_mode = false;  /* Replay allocation requests with calloc */
+static bool batch_mode = false;   /* Replay runs of requests with batch calls */
+static bool sized_mode = false;   /* Pass block sizes to free and realloc */
+static bool expand_mode = false;  /* Grow blocks in place before realloc */
+static bool stats_mode = false;   /* Print heap statistics at the payload peak */
+static bool instrument_mode = false; /* Print the hot path counters of mm.c */
+static bool instrumented = false; /* Was mm.c built with MM_INSTRUMENT? */
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
@@ -172,6 +212,13 @@ size_t queryGlobalSpaceUsage(void);
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* Names of the mm fit search policies, indexed by MM_FIT_* */
+static const char *fit_policy_names[] = {
+    "first", "class", "bestn", NULL
+};
+static bool compare_policies = false; /* Run traces under every fit policy */
+static int mt_threads = 0;  /* If set, measure scaling up to this many threads */
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -209,19 +256,21 @@ static void add_tracefile(char *trace);
 /* these functions manipulate range sets */
 static range_set_t *new_range_set();
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
-                      const trace_t *trace, int opnum, int index);
+                      size_t align, const trace_t *trace, int opnum, int index);
 static void remove_range(range_set_t *ranges, char *lo);
 static void free_range_set(range_set_t *ranges);
 
 /* These functions implement the debugging code */
 static void init_random_data(void);
 static bool check_index(const trace_t *trace, int opnum, int index);
+static bool check_zero(const trace_t *trace, int opnum, int index);
 static void randomize_block(trace_t *trace, int index);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
 static void reinit_trace(trace_t *trace);
+static int batch_run(const trace_t *trace, int opnum);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -231,11 +280,31 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum,
+                           size_t *heap_final, size_t *heap_peak, size_t *sbrks,
+                           size_t *expanded, struct mm_stats *heap_stats);
 static void eval_mm_speed(void *ptr);
+static bool try_expand(char *p, size_t oldsize, size_t newsize);
+
+/* Routine for comparing the fit search policies of the mm package */
+static void eval_fit_policies(void);
+
+/* Routines for measuring the throughput of the mm package with threads */
+static void eval_mm_threads(void);
+#ifdef THREAD_SAFE
+static double eval_mm_threads_speed(trace_t *trace, int nthreads,
+                                    size_t *heap, size_t *payload, int *nregions);
+static void *mt_replay(void *ptr);
+static void mt_account(mt_replay_t *replay, mt_payload_t *payload, int index,
+                       char *old, char *p, size_t size);
+#endif
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void printheaps(int n, stats_t *stats);
+static void printexpands(int n, stats_t *stats);
+static void printstats(int n, stats_t *stats);
+static void printcounters(int n, stats_t *stats);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -244,6 +313,7 @@ static void unix_error(const char *fmt, ...)
 static void app_error(const char *fmt, ...)
     __attribute__((format(printf, 1,2), noreturn));
 static double compute_scaled_score(double value, double min, double max);
+static double harmonic_throughput(int n, stats_t *stats);
 
 static sigjmp_buf timeout_jmpbuf;
 
@@ -300,7 +370,12 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         if (mm_stats[i].valid) {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i].heap_final,
+                                            &mm_stats[i].heap_peak,
+                                            &mm_stats[i].sbrks,
+                                            &mm_stats[i].expanded,
+                                            &mm_stats[i].heap_stats);
+            instrumented = mm_get_instrument(&mm_stats[i].counters);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
@@ -352,7 +427,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpOVAlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:P:M:hpOVAlBCDEFIST")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -409,6 +484,53 @@ int main(int argc, char **argv)
             tab_mode = true;
             break;
 
+        case 'C': /* Replay allocation requests with calloc */
+            calloc_mode = true;
+            break;
+
+        case 'B': /* Replay runs of requests with batch calls */
+            batch_mode = true;
+            break;
+
+        case 'S': /* Pass block sizes to free and realloc */
+            sized_mode = true;
+            break;
+
+        case 'E': /* Grow blocks in place before realloc */
+            expand_mode = true;
+            break;
+
+        case 'F': /* Print heap statistics at the payload peak */
+            stats_mode = true;
+            break;
+
+        case 'I': /* Print the hot path counters of mm.c */
+            instrument_mode = true;
+            break;
+
+        case 'P': /* Select fit search policy, or compare all of them */
+            if (strcmp(optarg, "all") == 0) {
+                compare_policies = true;
+                break;
+            }
+            for (i = 0; fit_policy_names[i]; i++) {
+                if (strcmp(optarg, fit_policy_names[i]) == 0)
+                    break;
+            }
+            if (fit_policy_names[i] == NULL || !mm_set_fit_policy(i)) {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+
+        case 'M': /* Measure throughput with up to this many threads */
+            mt_threads = atoi(optarg);
+            if (mt_threads < 1) {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -494,6 +616,21 @@ int main(int argc, char **argv)
     }
 #endif
 
+    /*
+     * Optionally measure how the mm package scales with threads
+     */
+    if (mt_threads > 0) {
+        eval_mm_threads();
+        exit(0);
+    }
+
+    /*
+     * Optionally compare the fit search policies of the mm package
+     */
+    if (compare_policies && !onetime_flag) {
+        eval_fit_policies();
+    }
+
     /*
      * Always run and evaluate the student's mm package
      */
@@ -524,6 +661,14 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
+            if (!tab_mode)
+                printheaps(num_global_tracefiles, mm_stats);
+            if (!tab_mode && expand_mode)
+                printexpands(num_global_tracefiles, mm_stats);
+            if (!tab_mode && stats_mode)
+                printstats(num_global_tracefiles, mm_stats);
+            if (!tab_mode && instrument_mode)
+                printcounters(num_global_tracefiles, mm_stats);
         }
     }
 
@@ -577,19 +722,8 @@ int main(int argc, char **argv)
         }
     }
 
-    /*
-     * Calulate harmonic mean throughput. Since we do not know the number of
-     * throughput-weighted tracefiles beforehand, we need to re-loop and
-     * calculate the throughputs.
-     */
-    for (i = 0; i < num_global_tracefiles; i++)
-    {
-        if (mm_stats[i].weight == WALL || mm_stats[i].weight == WPERF)
-        {
-            tput_harm += 1./mm_stats[i].tput;
-        }
-    }
-    tput_harm = (float)perf_weight / tput_harm;
+    /* Calculate harmonic mean throughput */
+    tput_harm = harmonic_throughput(num_global_tracefiles, mm_stats);
 
     if (util_weight == 0) {
         avg_mm_util = 0.0;
@@ -715,11 +849,12 @@ static range_set_t *new_range_set() {
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
- *     size bytes at addr lo. After checking the block for correctness,
+ *     size bytes at addr lo, aligned to align bytes (ALIGNMENT unless it
+ *     came from memalign). After checking the block for correctness,
  *     we create a range struct for this block and add it to the range list.
  */
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
-                      const trace_t *trace, int opnum, int index) {
+                      size_t align, const trace_t *trace, int opnum, int index) {
     char *hi = lo + size - 1;
 
     assert(size > 0);
@@ -731,12 +866,23 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* ... and memalign payloads to the requested alignment */
+    if ((unsigned long)lo % align != 0) {
+        malloc_error(trace, opnum,
+                     "Payload address (%p) not aligned to %zu bytes", lo, align);
+        return false;
+    }
+
+    /* The payload must lie within the extent of one heap region,
+       or of one mapping made with mem_mmap */
+    int region = mem_region_of(lo);
+    if (region < 0 && mem_is_mapped(lo, size)) {
+        /* Mapped outside of the heap */
+    } else if (region < 0 || hi > (char *)mem_region_hi(region)) {
+        region = (region < 0) ? 0 : region;
         malloc_error(trace, opnum,
                      "Payload (%p:%p) lies outside heap (%p:%p)",
-                     lo, hi, mem_heap_lo(), mem_heap_hi());
+                     lo, hi, mem_region_lo(region), mem_region_hi(region));
         return false;
     }
 
@@ -897,6 +1043,30 @@ static bool check_index(const trace_t *trace, int opnum, int index) {
     return true;
 }
 
+/*
+ * check_zero - check that the whole payload of a block returned by
+ *    calloc reads as zero
+ */
+static bool check_zero(const trace_t *trace, int opnum, int index) {
+    const char *block = trace->blocks[index];
+    size_t size = trace->block_sizes[index];
+    size_t i, len;
+
+    setUBCheck(false);
+    for (i = 0; i < size; i += len) {
+        len = (size - i < sizeof(uint64_t)) ? size - i : sizeof(uint64_t);
+        if (mem_read(&block[i], len) != 0)
+            break;
+    }
+    setUBCheck(true);
+    if (i < size) {
+        malloc_error(trace, opnum, "block %d (at %p) returned by calloc is "
+                     "not zero near byte %zu", index, block, i);
+        return false;
+    }
+    return true;
+}
+
 /**********************************************
  * The following routines manipulate tracefiles
  *********************************************/
@@ -911,7 +1081,8 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     trace_t *trace;
     char type[MAXLINE];
     int index;
-    size_t size;
+    size_t size, align;
+    size_t reallocs = 0;
     int max_index = 0;
     int op_index;
     int ignore = 0;
@@ -960,6 +1131,11 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
          calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
         unix_error("malloc 5 failed in read_trace");
 
+    /* and room for the pointers of a batch of requests */
+    if ((trace->batch =
+         (char **)calloc(trace->num_ops, sizeof(char *))) == NULL)
+        unix_error("malloc 6 failed in read_trace");
+
 
     /* read every request line in the trace file */
     index = 0;
@@ -968,7 +1144,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
         switch(type[0]) {
         case 'a':
             ignore += fscanf(tracefile, "%u %lu", &index, &size);
-            trace->ops[op_index].type = ALLOC;
+            trace->ops[op_index].type = calloc_mode ? CALLOC : ALLOC;
             trace->ops[op_index].index = index;
             trace->ops[op_index].size = size;
             max_index = (index > max_index) ? index : max_index;
@@ -985,10 +1161,30 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
             break;
+        case 'c':
+            ignore += fscanf(tracefile, "%u %lu", &index, &size);
+            trace->ops[op_index].type = CALLOC;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 'm':
+            ignore += fscanf(tracefile, "%u %lu %lu", &index, &align, &size);
+            if (align < sizeof(void *) || (align & (align - 1)) != 0)
+                app_error("Bad alignment (%zu) in tracefile %s\n",
+                          align, trace->filename);
+            trace->ops[op_index].type = MEMALIGN;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            trace->ops[op_index].align = align;
+            max_index = (index > max_index) ? index : max_index;
+            break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n",
                       type[0], trace->filename);
         }
+        if (trace->ops[op_index].type == REALLOC)
+            reallocs++;
         op_index++;
         if (op_index == trace->num_ops) break;
     }
@@ -1000,6 +1196,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     strcpy(stats->filename, trace->filename);
     stats->weight = trace->weight;
     stats->ops = trace->num_ops;
+    stats->reallocs = reallocs;
 
     return trace;
 }
@@ -1015,7 +1212,25 @@ static void reinit_trace(trace_t *trace)
 }
 
 /*
- * free_trace - Free the trace record and the four arrays it points
+ * batch_run - the number of requests from opnum on that batch mode
+ *    replays with one call: a run of mallocs of the same size, or a run
+ *    of frees.  1 if batch mode is off.
+ */
+static int batch_run(const trace_t *trace, int opnum)
+{
+    const traceop_t *op = &trace->ops[opnum];
+    int n = 1;
+
+    if (!batch_mode || (op->type != ALLOC && op->type != FREE))
+        return 1;
+    while (opnum + n < trace->num_ops && op[n].type == op->type &&
+           (op->type == FREE || op[n].size == op->size))
+        n++;
+    return n;
+}
+
+/*
+ * free_trace - Free the trace record and the five arrays it points
  *              to, all of which were allocated in read_trace().
  */
 static void free_trace(trace_t *trace)
@@ -1024,6 +1239,7 @@ static void free_trace(trace_t *trace)
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
+    free(trace->batch);
     free(trace);              /* and the trace record itself... */
 }
 
@@ -1037,9 +1253,9 @@ static void free_trace(trace_t *trace)
  */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 {
-    int i;
+    int i, k, n;
     int index;
-    size_t size;
+    size_t size, align;
     char *newp;
     char *oldp;
     char *p;
@@ -1083,10 +1299,33 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case CALLOC: /* mm_calloc */
+
+            /* In batch mode, allocate a run of same-size requests at once */
+            n = batch_run(trace, i);
+            if (n > 1) {
+                if (mm_malloc_batch(size, (void **)trace->batch, n) != (size_t)n) {
+                    malloc_error(trace, i, "mm_malloc_batch failed.");
+                    return false;
+                }
+                for (k = 0; k < n; k++) {
+                    index = trace->ops[i + k].index;
+                    if (add_range(ranges, trace->batch[k], size, ALIGNMENT,
+                                  trace, i + k, index) == 0)
+                        return false;
+                    trace->blocks[index] = trace->batch[k];
+                    trace->block_sizes[index] = size;
+                    randomize_block(trace, index);
+                }
+                i += n - 1;
+                break;
+            }
 
-            /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL) {
-                malloc_error(trace, i, "mm_malloc failed.");
+            /* Call the student's malloc or calloc */
+            p = (trace->ops[i].type == CALLOC) ? mm_calloc(1, size) : mm_malloc(size);
+            if (p == NULL) {
+                malloc_error(trace, i, trace->ops[i].type == CALLOC ?
+                             "mm_calloc failed." : "mm_malloc failed.");
                 return false;
             }
 
@@ -1095,7 +1334,36 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
              * to the range list if OK. The block must be  be aligned properly,
              * and must not overlap any currently allocated block.
              */
-            if (add_range(ranges, p, size, trace, i, index) == 0)
+            if (add_range(ranges, p, size, ALIGNMENT, trace, i, index) == 0)
+                return false;
+
+            /* Remember region */
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+
+            if (trace->ops[i].type == CALLOC && !check_zero(trace, i, index))
+                return false;
+
+            /* Set to random data, for debugging. */
+            randomize_block(trace, index);
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            /* Take turns among the three aligned allocation calls */
+            align = trace->ops[i].align;
+            if (i % 3 == 0)
+                p = mm_memalign(align, size);
+            else if (i % 3 == 1)
+                p = mm_aligned_alloc(align, size);
+            else if (mm_posix_memalign((void **)&p, align, size) != 0)
+                p = NULL;
+            if (p == NULL) {
+                malloc_error(trace, i, "mm_memalign failed.");
+                return false;
+            }
+
+            /* The block must also be aligned to the requested alignment */
+            if (add_range(ranges, p, size, align, trace, i, index) == 0)
                 return false;
 
             /* Remember region */
@@ -1115,7 +1383,12 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             /* Call the student's realloc */
             oldp = trace->blocks[index];
             setUBCheck(false);
-            newp = mm_realloc(oldp, size);
+            if (try_expand(oldp, trace->block_sizes[index], size))
+                newp = oldp;
+            else if (sized_mode)
+                newp = mm_realloc_sized(oldp, trace->block_sizes[index], size);
+            else
+                newp = mm_realloc(oldp, size);
             setUBCheck(true);
             if ( (newp == NULL) && (size != 0) ) {
                 malloc_error(trace, i, "mm_realloc failed.");
@@ -1132,7 +1405,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
             /* Check new block for correctness and add it to range list */
             if (size > 0) {
-                if (add_range(ranges, newp, size, trace, i, index) == 0)
+                if (add_range(ranges, newp, size, ALIGNMENT, trace, i, index) == 0)
                     return false;
             }
 
@@ -1156,6 +1429,22 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             break;
 
         case FREE: /* mm_free */
+            /* In batch mode, free a run of requests at once */
+            n = batch_run(trace, i);
+            if (n > 1) {
+                for (k = 0; k < n; k++) {
+                    index = trace->ops[i + k].index;
+                    if (!check_index(trace, i + k, index))
+                        allCheck = false;
+                    trace->batch[k] = (index == -1) ? NULL : trace->blocks[index];
+                    if (index != -1)
+                        remove_range(ranges, trace->batch[k]);
+                }
+                mm_free_batch((void **)trace->batch, n);
+                i += n - 1;
+                break;
+            }
+
             if (!check_index(trace, i, index))
             {
                 allCheck = false;
@@ -1168,7 +1457,10 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 p = trace->blocks[index];
                 remove_range(ranges, p);
             }
-            mm_free(p);
+            if (sized_mode)
+                mm_free_sized(p, (index == -1) ? 0 : trace->block_sizes[index]);
+            else
+                mm_free(p);
             break;
 
         default:
@@ -1184,16 +1476,22 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   peak size of the heap in bytes while running the student's malloc
+ *   package on the trace. The heap may shrink through a negative 
+ *   mem_sbrk(), so its final size, returned in heap_final, can be 
+ *   smaller than the peak, returned in heap_peak.  The number of times
+ *   the heap was extended is returned in sbrks, and the number of
+ *   reallocs that try_expand avoided in expanded.  With -F, a snapshot
+ *   of the heap taken when the payload first reaches its peak is 
+ *   returned in heap_stats.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum,
+                           size_t *heap_final, size_t *heap_peak, size_t *sbrks,
+                           size_t *expanded, struct mm_stats *heap_stats)
 {
-    int i;
+    int i, k, n;
     int index;
     size_t size, newsize, oldsize;
     size_t max_total_size = 0;
@@ -1212,10 +1510,28 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case CALLOC: /* mm_calloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
 
-            if ((p = mm_malloc(size)) == NULL) {
+            n = batch_run(trace, i);
+            if (n > 1) {
+                if (mm_malloc_batch(size, (void **)trace->batch, n) != (size_t)n) {
+                    app_error("trace %d: mm_malloc_batch failed in eval_mm_util",
+                              tracenum);
+                }
+                for (k = 0; k < n; k++) {
+                    index = trace->ops[i + k].index;
+                    trace->blocks[index] = trace->batch[k];
+                    trace->block_sizes[index] = size;
+                }
+                total_size += n * size;
+                i += n - 1;
+                break;
+            }
+
+            p = (trace->ops[i].type == CALLOC) ? mm_calloc(1, size) : mm_malloc(size);
+            if (p == NULL) {
                 app_error("trace %d: mm_malloc failed in eval_mm_util",
                           tracenum);
             }
@@ -1227,6 +1543,22 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             total_size += size;
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+
+            if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+                app_error("trace %d: mm_memalign failed in eval_mm_util",
+                          tracenum);
+            }
+
+            /* Remember region and size */
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+
+            total_size += size;
+            break;
+
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1234,7 +1566,15 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 
             oldp = trace->blocks[index];
             setUBCheck(false);
-            if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0) {
+            if (try_expand(oldp, oldsize, newsize)) {
+                newp = oldp;
+                (*expanded)++;
+            } else if (sized_mode) {
+                newp = mm_realloc_sized(oldp, oldsize, newsize);
+            } else {
+                newp = mm_realloc(oldp, newsize);
+            }
+            if (newp == NULL && newsize != 0) {
                 app_error("trace %d: mm_realloc failed in eval_mm_util",
                           tracenum);
             }
@@ -1248,6 +1588,19 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             break;
 
         case FREE: /* mm_free */
+            n = batch_run(trace, i);
+            if (n > 1) {
+                for (k = 0; k < n; k++) {
+                    index = trace->ops[i + k].index;
+                    trace->batch[k] = (index < 0) ? NULL : trace->blocks[index];
+                    if (index >= 0)
+                        total_size -= trace->block_sizes[index];
+                }
+                mm_free_batch((void **)trace->batch, n);
+                i += n - 1;
+                break;
+            }
+
             index = trace->ops[i].index;
             if (index < 0) {
                 size = 0;
@@ -1257,7 +1610,10 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 p = trace->blocks[index];
             }
 
-            mm_free(p);
+            if (sized_mode)
+                mm_free_sized(p, size);
+            else
+                mm_free(p);
 
             total_size -= size;
             break;
@@ -1268,15 +1624,21 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         }
 
         /* update the high-water mark */
-        max_total_size = (total_size > max_total_size) ?
-            total_size : max_total_size;
+        if (total_size > max_total_size) {
+            max_total_size = total_size;
+            if (stats_mode)
+                mm_get_stats(heap_stats);
+        }
     }
 
 #if !REF_ONLY
     printf(".");
 #endif
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    *heap_final = mem_heapsize();
+    *heap_peak = mem_heap_peak();
+    *sbrks = mem_sbrk_count();
+    return ((double)max_total_size / (double)mem_heap_peak());
 }
 
 
@@ -1286,10 +1648,11 @@ static double eval_mm_util(trace_t *trace, int tracenum)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index;
+    int i, k, n, index;
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
+    bool track_sizes = sized_mode || expand_mode; /* block_sizes needed */
     reinit_trace(trace);
 
     /* Reset the heap and initialize the mm package */
@@ -1304,9 +1667,44 @@ static void eval_mm_speed(void *ptr)
         case ALLOC: /* mm_malloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
+            n = batch_run(trace, i);
+            if (n > 1) {
+                if (mm_malloc_batch(size, (void **)trace->batch, n) != (size_t)n)
+                    app_error("mm_malloc_batch error in eval_mm_speed");
+                for (k = 0; k < n; k++) {
+                    index = trace->ops[i + k].index;
+                    trace->blocks[index] = trace->batch[k];
+                    if (track_sizes)
+                        trace->block_sizes[index] = size;
+                }
+                i += n - 1;
+                break;
+            }
             if ((p = mm_malloc(size)) == NULL)
                 app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
+            if (track_sizes)
+                trace->block_sizes[index] = size;
+            break;
+
+        case CALLOC: /* mm_calloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_calloc(1, size)) == NULL)
+                app_error("mm_calloc error in eval_mm_speed");
+            trace->blocks[index] = p;
+            if (track_sizes)
+                trace->block_sizes[index] = size;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+                app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            if (track_sizes)
+                trace->block_sizes[index] = size;
             break;
 
         case REALLOC: /* mm_realloc */
@@ -1314,20 +1712,42 @@ static void eval_mm_speed(void *ptr)
             newsize = trace->ops[i].size;
             oldp = trace->blocks[index];
             setUBCheck(false);
-            if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
+            if (try_expand(oldp, trace->block_sizes[index], newsize)) {
+                newp = oldp;
+            } else if (sized_mode) {
+                newp = mm_realloc_sized(oldp, trace->block_sizes[index], newsize);
+            } else {
+                newp = mm_realloc(oldp, newsize);
+            }
+            if (track_sizes)
+                trace->block_sizes[index] = newsize;
+            if (newp == NULL && newsize != 0)
                 app_error("mm_realloc error in eval_mm_speed");
             setUBCheck(true);
             trace->blocks[index] = newp;
             break;
 
         case FREE: /* mm_free */
+            n = batch_run(trace, i);
+            if (n > 1) {
+                for (k = 0; k < n; k++) {
+                    index = trace->ops[i + k].index;
+                    trace->batch[k] = (index < 0) ? NULL : trace->blocks[index];
+                }
+                mm_free_batch((void **)trace->batch, n);
+                i += n - 1;
+                break;
+            }
             index = trace->ops[i].index;
             if (index < 0) {
                 block = 0;
             } else {
                 block = trace->blocks[index];
             }
-            mm_free(block);
+            if (sized_mode)
+                mm_free_sized(block, (index < 0) ? 0 : trace->block_sizes[index]);
+            else
+                mm_free(block);
             break;
 
         default:
@@ -1335,6 +1755,19 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * try_expand - in expand mode, grows block p from oldsize to newsize
+ *    bytes without realloc, into the usable size of the block or in
+ *    place with mm_try_expand.  Returns true if the realloc of the
+ *    request can be skipped.
+ */
+static bool try_expand(char *p, size_t oldsize, size_t newsize)
+{
+    if (!expand_mode || p == NULL || newsize <= oldsize)
+        return false;
+    return newsize <= mm_usable_size(p) || mm_try_expand(p, newsize);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1360,6 +1793,22 @@ static bool eval_libc_valid(trace_t *trace)
             trace->blocks[trace->ops[i].index] = p;
             break;
 
+        case CALLOC: /* calloc */
+            if ((p = calloc(1, trace->ops[i].size)) == NULL) {
+                malloc_error(trace, i, "libc calloc failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
+        case MEMALIGN: /* aligned_alloc */
+            if ((p = aligned_alloc(trace->ops[i].align, trace->ops[i].size)) == NULL) {
+                malloc_error(trace, i, "libc aligned_alloc failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
         case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
             oldp = trace->blocks[trace->ops[i].index];
@@ -1411,6 +1860,22 @@ static void eval_libc_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case CALLOC: /* calloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = calloc(1, size)) == NULL)
+                unix_error("calloc failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
+        case MEMALIGN: /* aligned_alloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = aligned_alloc(trace->ops[i].align, size)) == NULL)
+                unix_error("aligned_alloc failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1439,6 +1904,416 @@ static void eval_libc_speed(void *ptr)
  ************************************/
 
 
+/*
+ * eval_fit_policies - runs the traces once under each fit search policy
+ *                     of the mm package and prints the utilization and
+ *                     throughput of each side by side. Leaves the package
+ *                     with the default first fit policy.
+ */
+static void eval_fit_policies(void)
+{
+    int p;
+    speed_t speed_params;
+    sum_stats_t policy_stats[sizeof(fit_policy_names) / sizeof(char *)];
+    double policy_tput[sizeof(fit_policy_names) / sizeof(char *)];
+
+    stats_t *stats = (stats_t *)calloc(num_global_tracefiles, sizeof(stats_t));
+    if (stats == NULL)
+        unix_error("stats calloc in eval_fit_policies failed");
+
+    for (p = 0; fit_policy_names[p]; p++) {
+        mm_set_fit_policy(p);
+        memset(stats, 0, num_global_tracefiles * sizeof(stats_t));
+        run_tests(num_global_tracefiles, tracedir, global_tracefiles, stats,
+                  &speed_params);
+        printf("\nResults for mm malloc with %s fit policy:\n",
+               fit_policy_names[p]);
+        printresults(num_global_tracefiles, stats, &policy_stats[p]);
+        policy_tput[p] = sparse_mode ? 0.0
+            : harmonic_throughput(num_global_tracefiles, stats);
+    }
+
+    printf("\nFit policy comparison:\n");
+    printf("  %-8s%8s%10s\n", "policy", "util", "Kops/s");
+    for (p = 0; fit_policy_names[p]; p++) {
+        printf("  %-8s%7.1f%%%10.0f\n", fit_policy_names[p],
+               policy_stats[p].util * 100.0, policy_tput[p]);
+    }
+    printf("\n");
+
+    mm_set_fit_policy(MM_FIT_FIRST);
+    free(stats);
+}
+
+/*
+ * eval_mm_threads - replays each trace concurrently in 1, 2, 4, ... and
+ *                   finally mt_threads threads sharing one heap, each
+ *                   thread with its own copy of the trace's blocks, and
+ *                   prints the aggregate throughput and the utilization of
+ *                   each heap region (arena) the mm package used. Needs the
+ *                   thread-safe build of the mm package (mdriver-mt).
+ */
+static void eval_mm_threads(void)
+{
+#ifdef THREAD_SAFE
+    int i, n, r;
+
+    printf("\nThread scaling for mm malloc (aggregate Kops/s):\n");
+    printf("  %7s%8s%10s%9s%7s  %s\n", "threads", "ops", "msecs", "Kops/s",
+           "util", "trace");
+    for (i = 0; i < num_global_tracefiles; i++) {
+        stats_t stats;
+        trace_t *trace = read_trace(&stats, tracedir, global_tracefiles[i]);
+
+        for (n = 1; n <= mt_threads; n = (n < mt_threads && 2 * n > mt_threads)
+                                             ? mt_threads : 2 * n) {
+            size_t heap[MEM_MAX_REGIONS], payload[MEM_MAX_REGIONS];
+            size_t heap_total = 0, payload_total = 0;
+            int nregions;
+            double secs = eval_mm_threads_speed(trace, n, heap, payload, &nregions);
+            double ops = (double)trace->num_ops * n;
+            for (r = 0; r < nregions; r++) {
+                heap_total += heap[r];
+                payload_total += payload[r];
+            }
+            printf("  %7d%8.0f%10.3f%9.0f%6.1f%%  %s\n", n, ops, secs * 1000.0,
+                   ops / (secs * 1000.0),
+                   100.0 * payload_total / heap_total, trace->filename);
+            if (nregions > 1) {
+                for (r = 0; r < nregions; r++)
+                    printf("  %7s arena %d: %10zu heap bytes%6.1f%% util\n", "",
+                           r, heap[r], heap[r] ? 100.0 * payload[r] / heap[r] : 0.0);
+            }
+        }
+        free_trace(trace);
+    }
+#else
+    app_error("Multithreaded mode (-M) needs the thread-safe driver mdriver-mt");
+#endif
+}
+
+#ifdef THREAD_SAFE
+/*
+ * eval_mm_threads_speed - runs nthreads concurrent replays of a trace on a
+ *                         fresh heap and returns the wall time from the
+ *                         first replay starting to the last one finishing.
+ *                         Also returns the peak size and the peak 
+ *                         payload of each of the nregions heap regions.
+ *                         Threads count their payload privately, and the
+ *                         peak payload of a region is the sum of the peaks
+ *                         of its threads: exact when each region serves
+ *                         one thread, an upper bound otherwise.
+ */
+static double eval_mm_threads_speed(trace_t *trace, int nthreads,
+                                    size_t *heap, size_t *payload, int *nregions)
+{
+    int t, r;
+    double begin = DBL_MAX, end = 0.0;
+    pthread_barrier_t start;
+    pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+    mt_replay_t *replays = malloc(nthreads * sizeof(mt_replay_t));
+    if (tids == NULL || replays == NULL)
+        unix_error("malloc in eval_mm_threads_speed failed");
+
+    mem_init(sparse_mode);
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_threads_speed");
+
+    pthread_barrier_init(&start, NULL, nthreads);
+    for (t = 0; t < nthreads; t++) {
+        replays[t].trace = trace;
+        replays[t].blocks = calloc(trace->num_ids, sizeof(char *));
+        replays[t].sizes = calloc(trace->num_ids, sizeof(size_t));
+        replays[t].regions = malloc(trace->num_ids);
+        replays[t].start = &start;
+        if (replays[t].blocks == NULL || replays[t].sizes == NULL ||
+            replays[t].regions == NULL)
+            unix_error("calloc in eval_mm_threads_speed failed");
+        memset(replays[t].regions, -1, trace->num_ids);
+        if (pthread_create(&tids[t], NULL, mt_replay, &replays[t]) != 0)
+            unix_error("pthread_create in eval_mm_threads_speed failed");
+    }
+
+    /* Elapsed time runs from the first start to the last finish */
+    for (t = 0; t < nthreads; t++) {
+        pthread_join(tids[t], NULL);
+        double t_begin = replays[t].begin.tv_sec + replays[t].begin.tv_nsec / 1e9;
+        double t_end = replays[t].end.tv_sec + replays[t].end.tv_nsec / 1e9;
+        begin = (t_begin < begin) ? t_begin : begin;
+        end = (t_end > end) ? t_end : end;
+    }
+
+    *nregions = mem_region_count();
+    for (r = 0; r < *nregions; r++) {
+        heap[r] = mem_region_peak(r);
+        payload[r] = 0;
+        for (t = 0; t < nthreads; t++)
+            payload[r] += replays[t].peak[r];
+    }
+    for (t = 0; t < nthreads; t++) {
+        free(replays[t].blocks);
+        free(replays[t].sizes);
+        free(replays[t].regions);
+    }
+    pthread_barrier_destroy(&start);
+    free(replays);
+    free(tids);
+    mem_deinit();
+
+    return end - begin;
+}
+
+/*
+ * mt_replay - thread routine replaying all requests of a trace
+ */
+static void *mt_replay(void *ptr)
+{
+    mt_replay_t *replay = (mt_replay_t *)ptr;
+    const trace_t *trace = replay->trace;
+    char **blocks = replay->blocks;
+    char *old;
+    int i, index;
+    mt_payload_t payload;
+
+    memset(&payload, 0, sizeof(payload));
+    pthread_barrier_wait(replay->start);
+    clock_gettime(CLOCK_MONOTONIC, &replay->begin);
+    for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            if ((blocks[index] = mm_malloc(trace->ops[i].size)) == NULL)
+                app_error("mm_malloc error in mt_replay");
+            mt_account(replay, &payload, index, NULL, blocks[index],
+                       trace->ops[i].size);
+            break;
+
+        case CALLOC: /* mm_calloc */
+            if ((blocks[index] = mm_calloc(1, trace->ops[i].size)) == NULL)
+                app_error("mm_calloc error in mt_replay");
+            mt_account(replay, &payload, index, NULL, blocks[index],
+                       trace->ops[i].size);
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            blocks[index] = mm_memalign(trace->ops[i].align, trace->ops[i].size);
+            if (blocks[index] == NULL)
+                app_error("mm_memalign error in mt_replay");
+            mt_account(replay, &payload, index, NULL, blocks[index],
+                       trace->ops[i].size);
+            break;
+
+        case REALLOC: /* mm_realloc */
+            old = blocks[index];
+            if (try_expand(old, replay->sizes[index], trace->ops[i].size))
+                blocks[index] = old;
+            else if (sized_mode)
+                blocks[index] = mm_realloc_sized(old, replay->sizes[index],
+                                                 trace->ops[i].size);
+            else
+                blocks[index] = mm_realloc(old, trace->ops[i].size);
+            if (blocks[index] == NULL && trace->ops[i].size != 0)
+                app_error("mm_realloc error in mt_replay");
+            mt_account(replay, &payload, index, old, blocks[index],
+                       trace->ops[i].size);
+            break;
+
+        case FREE: /* mm_free */
+            if (index >= 0) {
+                size_t size = replay->sizes[index];
+                mt_account(replay, &payload, index, blocks[index], NULL, 0);
+                if (sized_mode)
+                    mm_free_sized(blocks[index], size);
+                else
+                    mm_free(blocks[index]);
+            } else {
+                mm_free(NULL);
+            }
+            break;
+
+        default:
+            app_error("Nonexistent request type in mt_replay");
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &replay->end);
+    memcpy(replay->peak, payload.peak, sizeof(replay->peak));
+    return NULL;
+}
+
+/*
+ * mt_account - moves the payload of block index of a replay from the heap
+ *              region holding old to the region holding p, where it has
+ *              the given payload size (either pointer may be NULL), in 
+ *              the counters of the replaying thread. The region of a block
+ *              is looked up once when it moves. Blocks mapped outside of
+ *              the heap regions are not counted.
+ */
+static void mt_account(mt_replay_t *replay, mt_payload_t *payload, int index,
+                       char *old, char *p, size_t size)
+{
+    int r = replay->regions[index];
+
+    if (old != NULL && r >= 0)
+        payload->live[r] -= replay->sizes[index];
+    if (p == NULL)
+        r = -1;
+    else if (p != old)
+        r = mem_region_of(p);
+    replay->sizes[index] = (p == NULL) ? 0 : size;
+    replay->regions[index] = r;
+    if (r >= 0) {
+        payload->live[r] += size;
+        if (payload->live[r] > payload->peak[r])
+            payload->peak[r] = payload->live[r];
+    }
+}
+#endif
+
+/*
+ * printheaps - prints the final and peak heap size of each trace run by
+ *              the mm malloc package, and how often the heap was extended
+ */
+static void printheaps(int n, stats_t *stats)
+{
+    int i;
+
+    printf("Heap size for mm malloc (KB):\n");
+    printf("  %10s%10s%7s%8s  %s\n", "final", "peak", "final%", "sbrks", "trace");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].heap_peak == 0)
+            continue;
+        printf("  %10.1f%10.1f%6.1f%%%8zu  %s\n", stats[i].heap_final / 1024.0,
+               stats[i].heap_peak / 1024.0,
+               100.0 * stats[i].heap_final / stats[i].heap_peak,
+               stats[i].sbrks, stats[i].filename);
+    }
+    printf("\n");
+}
+
+/*
+ * printexpands - prints how many reallocs of each trace run by the mm
+ *                malloc package were avoided by growing blocks in place
+ */
+static void printexpands(int n, stats_t *stats)
+{
+    int i;
+
+    printf("Reallocs avoided by growing in place:\n");
+    printf("  %10s%10s%10s  %s\n", "reallocs", "avoided", "avoided%", "trace");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].reallocs == 0)
+            continue;
+        printf("  %10zu%10zu%9.1f%%  %s\n", stats[i].reallocs,
+               stats[i].expanded,
+               100.0 * stats[i].expanded / stats[i].reallocs,
+               stats[i].filename);
+    }
+    printf("\n");
+}
+
+/*
+ * printstats - prints the heap snapshot taken at the payload peak of each
+ *              trace run by the mm malloc package: free memory, the free
+ *              blocks of each size class, and memory held by quick lists
+ *              and slab pages
+ */
+static void printstats(int n, stats_t *stats)
+{
+    int i, c;
+
+    printf("Heap at peak payload (KB):\n");
+    printf("  %8s%8s%8s%8s%8s%8s%8s  %s\n", "heap", "free", "blocks",
+           "largest", "wild", "quick", "slabs", "trace");
+    for (i = 0; i < n; i++) {
+        struct mm_stats *hs = &stats[i].heap_stats;
+        if (!stats[i].valid || hs->heap_size == 0)
+            continue;
+        printf("  %8.1f%8.1f%8zu%8.1f%8.1f%8.1f%8zu  %s\n",
+               hs->heap_size / 1024.0, hs->free_bytes / 1024.0,
+               hs->free_blocks, hs->largest_free / 1024.0,
+               hs->wilderness / 1024.0, hs->quick_bytes / 1024.0,
+               hs->slab_pages, stats[i].filename);
+    }
+    printf("\n");
+
+    printf("Free blocks per size class at peak payload:\n ");
+    for (c = 0; c < MM_STATS_CLASSES; c++) {
+        char label[16];
+        size_t lo = (size_t)16 << c;
+        if (lo >= 1024)
+            sprintf(label, "%zuK%s", lo / 1024, c == MM_STATS_CLASSES - 1 ? "+" : "");
+        else
+            sprintf(label, "%zu", lo);
+        printf("%6s", label);
+    }
+    printf("  trace\n");
+    for (i = 0; i < n; i++) {
+        struct mm_stats *hs = &stats[i].heap_stats;
+        if (!stats[i].valid || hs->heap_size == 0)
+            continue;
+        printf(" ");
+        for (c = 0; c < MM_STATS_CLASSES; c++)
+            printf("%6zu", hs->class_blocks[c]);
+        printf("  %s\n", stats[i].filename);
+    }
+    printf("\n");
+}
+
+/*
+ * printcounters - prints the hot path counters of the mm malloc package
+ *                 for the utilization run of each trace: how many free 
+ *                 blocks fit searches inspected, how often each case of
+ *                 coalescing happened, and how often blocks were split
+ */
+static void printcounters(int n, stats_t *stats)
+{
+    int i, b;
+
+    if (!instrumented) {
+        printf("Hot path counters: mm.c was built without MM_INSTRUMENT\n\n");
+        return;
+    }
+
+    printf("Fit searches by free blocks inspected:\n");
+    printf("  %8s%8s%7s", "searches", "misses", "avg");
+    for (b = 0; b < MM_PROBE_BUCKETS; b++) {
+        char label[16];
+        if (b == 0 || b == 1)
+            sprintf(label, "%d", b);
+        else if (b == MM_PROBE_BUCKETS - 1)
+            sprintf(label, "%d+", 1 << (b - 1));
+        else
+            sprintf(label, "%d-%d", 1 << (b - 1), (1 << b) - 1);
+        printf("%8s", label);
+    }
+    printf("  trace\n");
+    for (i = 0; i < n; i++) {
+        struct mm_instrument *c = &stats[i].counters;
+        if (!stats[i].valid)
+            continue;
+        printf("  %8zu%8zu%7.1f", c->fit_searches, c->fit_misses,
+               c->fit_searches ? (double)c->fit_probes / c->fit_searches : 0.0);
+        for (b = 0; b < MM_PROBE_BUCKETS; b++)
+            printf("%8zu", c->probe_hist[b]);
+        printf("  %s\n", stats[i].filename);
+    }
+    printf("\n");
+
+    printf("Coalesce cases and splits:\n");
+    printf("  %8s%8s%8s%8s%8s%9s  %s\n", "neither", "next", "prev", "both",
+           "splits", "declined", "trace");
+    for (i = 0; i < n; i++) {
+        struct mm_instrument *c = &stats[i].counters;
+        if (!stats[i].valid)
+            continue;
+        printf("  %8zu%8zu%8zu%8zu%8zu%9zu  %s\n", c->coalesce[0],
+               c->coalesce[1], c->coalesce[2], c->coalesce[3], c->splits,
+               c->split_declined, stats[i].filename);
+    }
+    printf("\n");
+}
+
 /*
  * printresults - prints a performance summary for some malloc package and returns
  *                a summary of the stats to the caller.
@@ -1665,6 +2540,24 @@ static double compute_scaled_score(double value, double lo, double hi) {
     else return (value - lo) / (hi - lo);
 }
 
+/*
+ * harmonic_throughput: Returns the harmonic mean throughput in Kops/s of the
+ * n traces in stats that count for performance, as used in the performance
+ * index, or 0.0 if none does.
+ */
+static double harmonic_throughput(int n, stats_t *stats) {
+    double tput_harm = 0.0;
+    int i, perf_weight = 0;
+
+    for (i = 0; i < n; i++) {
+        if (stats[i].weight == WALL || stats[i].weight == WPERF) {
+            tput_harm += 1./stats[i].tput;
+            perf_weight++;
+        }
+    }
+    return perf_weight == 0 ? 0.0 : (float)perf_weight / tput_harm;
+}
+
 /*****
  * Routines for reference throughput lookup
  *****/
@@ -1844,4 +2737,12 @@ static void usage(char *prog)
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-P <p>     Fit policy: first, class, bestn or all to compare\n");
+    fprintf(stderr, "\t-M <n>     Measure throughput with up to n threads (mdriver-mt)\n");
+    fprintf(stderr, "\t-C         Replay allocation requests with calloc\n");
+    fprintf(stderr, "\t-B         Replay runs of same-size mallocs and of frees in batches\n");
+    fprintf(stderr, "\t-S         Replay frees and reallocs with mm_free_sized and mm_realloc_sized\n");
+    fprintf(stderr, "\t-E         Grow blocks into their usable size or in place before realloc\n");
+    fprintf(stderr, "\t-F         Print heap statistics at the payload peak of each trace\n");
+    fprintf(stderr, "\t-I         Print the hot path counters of each trace (mdriver-instrument)\n");
 }
@@ -31,7 +31,33 @@
  *  in non-emulation, as it was to the same page as actual heap data.  But
  *  sparse emulation has tighter checks.  Commonly, the CPU reports a
  *  BUS ERROR on these accesses, and should be debugged as segmentation faults.
+ *
+ * Besides the main heap (region 0), an allocator may request up to
+ *  MEM_MAX_REGIONS - 1 additional heap regions with mem_region_new, each
+ *  with its own break.  Dense regions are separate mappings; sparse regions
+ *  are disjoint slices of the emulated address space and share its pages.
+ *
+ * Extending a dense region only moves its break within the reservation made
+ *  by mmap.  When built with MEM_LAZY_COMMIT, the reservation starts out
+ *  inaccessible, and memory is committed with mprotect as the break grows
+ *  and decommitted as it shrinks.
+ *
+ * mem_mmap hands out page-aligned blocks of memory outside of the heap
+ *  regions, which mem_munmap releases.  Dense mappings are real mmaps.
+ *  Sparse mappings are placed in the first gap between the live mappings
+ *  of a slice of the emulated address space above the heap regions that
+ *  holds them, and mem_munmap gives their emulated pages back.  Emulated
+ *  accesses to that slice must lie within a live mapping.  Mapped bytes
+ *  count towards mem_heapsize.
+ *
+ * mem_mremap resizes a mapping without copying its contents.  Dense mode
+ *  uses the mremap system call.  Sparse mode resizes a mapping in place
+ *  when the gap above it allows, and otherwise moves the emulated pages of
+ *  a mapping to a new address by changing their page IDs.
  */
+/* For mremap */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -42,6 +68,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sched.h>
 
 #include "memlib.h"
 #include "config.h"
@@ -54,17 +81,44 @@ typedef struct MBLK {
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/* A contiguous heap region with its own break */
+typedef struct {
+    unsigned char *lo;                     /* Starting address of region */
+    unsigned char *brk;                    /* Current position of break */
+    unsigned char *peak_brk;               /* Highest break since the last reset */
+    unsigned char *clean_brk;              /* Memory from here on was never handed out */
+    unsigned char *commit_brk;             /* End of committed memory */
+    unsigned char *max_addr;               /* Maximum allowable address */
+} mem_region_t;
+
 /* private global variables */
 static bool sparse = false;                 /* Use sparse memory emulation */
-static unsigned char *heap;                 /* Starting address of heap */
-static unsigned char *mem_brk;              /* Current position of break */
-static unsigned char *mem_max_addr;         /* Maximum allowable heap address */
+static mem_region_t regions[MEM_MAX_REGIONS]; /* Region 0 is the main heap */
+static int num_regions = 1;                 /* Regions in use */
+static int mapped_regions = 1;              /* Regions with address space reserved */
+static size_t heap_total = 0;               /* Total size of all regions and mappings */
+static size_t heap_peak = 0;                /* Maximum of heap_total */
+static size_t sbrk_count = 0;               /* Heap extensions since the last reset */
+
+/* A block of memory handed out by mem_mmap */
+typedef struct {
+    unsigned char *addr;                   /* Starting address, page aligned */
+    size_t len;                            /* Length, a multiple of MEM_MAP_ALIGN */
+} mem_mapping_t;
+
+static mem_mapping_t *mappings = NULL;      /* Live mappings sorted by address */
+static size_t num_mappings = 0;             /* Number of live mappings */
+static size_t max_mappings = 0;             /* Capacity of mappings */
+static unsigned char *map_lo;               /* Start of sparse mapping space */
+static unsigned char *map_hi;               /* End of sparse mapping space */
+static bool map_locked = false;             /* Spin lock of the mapping table */
 static size_t mmap_length = MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
 static bool show_stats = false;             /* Should program print allocation information? */
 static bool stats_printed = false;          /* Has information been printed about allocation */
 
 /* Sparse memory representation */
 static mem_block_t *next_free_page = NULL;  /* Next free page */
+static mem_block_t *free_pages = NULL;      /* Pages released by mem_munmap */
 static size_t num_pages = 0;                /* Total number of pages */
 static size_t num_free_pages = 0;           /* Number of free pages */
 static mem_block_t **page_table = NULL;     /* Hash table from page ID to page */
@@ -83,6 +137,20 @@ void setUBCheck(bool val)
 static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
+static bool in_heap(const void *addr, size_t len);
+static void heap_add(intptr_t incr);
+static void map_lock(void);
+static void map_unlock(void);
+static size_t map_find(const void *addr);
+static void map_insert(unsigned char *addr, size_t len);
+static void map_remove(size_t i);
+static unsigned char *map_place(size_t len);
+static void pages_free(const unsigned char *addr, size_t len);
+static void pages_move(const unsigned char *old_addr, const unsigned char *new_addr,
+                       size_t len);
+static int region_prot(void);
+static bool region_commit(mem_region_t *rp);
+static void region_decommit(mem_region_t *rp);
 static void print_stats();
 
 /* 
@@ -114,7 +182,7 @@ void mem_init(bool do_sparse){
     void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
     void *addr = mmap(start,        /* suggested start*/
             mmap_length,  /* length */
-            PROT_WRITE,   /* permissions */
+            sparse ? PROT_WRITE : region_prot(), /* permissions */
             MAP_PRIVATE,  /* private or shared? */
             dev_zero,     /* fd */
             0);           /* offset */
@@ -125,14 +193,19 @@ void mem_init(bool do_sparse){
     if (sparse) {
         /* Use initial space for page table */
         page_table = (mem_block_t **) addr;
-        heap = SPARSE_HEAP_START;
-        mem_max_addr = heap + MAX_SPARSE_HEAP;
+        regions[0].lo = SPARSE_HEAP_START;
+        regions[0].max_addr = regions[0].lo + MAX_SPARSE_HEAP / MEM_MAX_REGIONS;
+        map_lo = regions[0].lo + MAX_SPARSE_HEAP;
+        map_hi = map_lo + MAX_SPARSE_HEAP;
     } else {
-        heap = addr;
-        mem_max_addr = heap + MAX_DENSE_HEAP;
+        regions[0].lo = addr;
+        regions[0].max_addr = regions[0].lo + MAX_DENSE_HEAP;
     }
+    regions[0].commit_brk = MEM_LAZY_COMMIT ? regions[0].lo : regions[0].max_addr;
+    regions[0].clean_brk = regions[0].lo;
     stats_printed = false;
-    mem_brk = heap;
+    num_regions = mapped_regions = 1;
+    regions[0].brk = regions[0].peak_brk = regions[0].lo;
     mem_reset_brk();
 }
 
@@ -141,15 +214,28 @@ void mem_init(bool do_sparse){
  */
 void mem_deinit(void){
     print_stats();
-    munmap(heap, mmap_length);
+    mem_reset_brk();
+    free(mappings);
+    mappings = NULL;
+    max_mappings = 0;
+    munmap(regions[0].lo, mmap_length);
+    if (!sparse) {
+        int r;
+        for (r = 1; r < mapped_regions; r++)
+            munmap(regions[r].lo, MAX_DENSE_HEAP);
+    }
+    num_regions = mapped_regions = 1;
     next_free_page = NULL;
+    free_pages = NULL;
     num_free_pages = 0;
     page_table = NULL;
     num_buckets = 0;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap.
+ *    Additional regions are dropped, but keep their mappings for reuse.
+ *    Blocks handed out by mem_mmap are released.
  */
 void mem_reset_brk(){
     print_stats();
@@ -159,34 +245,167 @@ void mem_reset_brk(){
         memset((void *) page_table, 0, ptb);
         /* First page is just beyond page table */
         next_free_page = (mem_block_t *) ((unsigned char *) page_table + ptb);
+        free_pages = NULL;
         num_free_pages = num_pages;
     }
-    mem_brk = heap;
+    int r;
+    for (r = 0; r < mapped_regions; r++) {
+        regions[r].brk = regions[r].peak_brk = regions[r].lo;
+        region_decommit(&regions[r]);
+    }
+    num_regions = 1;
+
+    if (!sparse) {
+        size_t i;
+        for (i = 0; i < num_mappings; i++)
+            munmap(mappings[i].addr, mappings[i].len);
+    }
+    num_mappings = 0;
+    heap_total = heap_peak = 0;
+    sbrk_count = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *                by incr bytes and returns the start address of the new area. In
- *                this model, the heap cannot be shrunk.
+ *                by incr bytes and returns the start address of the new area.
+ *                A negative incr shrinks the heap, down to its start.
  */
 void *mem_sbrk(intptr_t incr) {
-    unsigned char *old_brk = mem_brk;
+    return mem_region_sbrk(0, incr);
+}
+
+/*
+ * mem_heap_lo - return address of the first heap byte
+ */
+void *mem_heap_lo(){
+    return mem_region_lo(0);
+}
+
+/* 
+ * mem_heap_hi - return address of last heap byte
+ */
+void *mem_heap_hi(){
+    return mem_region_hi(0);
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes, summed over all regions
+ */
+size_t mem_heapsize() {
+    return __atomic_load_n(&heap_total, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_heap_peak() - returns the largest heap size since the last reset
+ */
+size_t mem_heap_peak() {
+    return __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_sbrk_count() - returns the number of times a heap region was
+ *    extended since the last reset
+ */
+size_t mem_sbrk_count() {
+    return __atomic_load_n(&sbrk_count, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_region_new - add an empty heap region and return its index,
+ *    or -1 if no more regions are available
+ */
+int mem_region_new(void) {
+    if (num_regions == MEM_MAX_REGIONS) {
+        fprintf(stderr, "ERROR: mem_region_new failed.  All %d regions in use\n", MEM_MAX_REGIONS);
+        return -1;
+    }
+    int r = num_regions;
+    if (r == mapped_regions) {
+        if (sparse) {
+            regions[r].lo = regions[0].lo + r * (MAX_SPARSE_HEAP / MEM_MAX_REGIONS);
+        } else {
+            int dev_zero = open("/dev/zero", O_RDWR);
+            void *addr = mmap(NULL, MAX_DENSE_HEAP, region_prot(), MAP_PRIVATE, dev_zero, 0);
+            close(dev_zero);
+            if (addr == MAP_FAILED) {
+                fprintf(stderr, "ERROR: mem_region_new failed.  mmap couldn't allocate space for region\n");
+                return -1;
+            }
+            regions[r].lo = addr;
+        }
+        regions[r].max_addr = regions[r].lo +
+            (sparse ? MAX_SPARSE_HEAP / MEM_MAX_REGIONS : MAX_DENSE_HEAP);
+        regions[r].commit_brk = MEM_LAZY_COMMIT ? regions[r].lo : regions[r].max_addr;
+        regions[r].clean_brk = regions[r].lo;
+        mapped_regions++;
+    }
+    regions[r].brk = regions[r].peak_brk = regions[r].lo;
+    /* Threads looking up regions without a lock see the bounds first */
+    __atomic_store_n(&num_regions, r + 1, __ATOMIC_RELEASE);
+    return r;
+}
+
+/*
+ * mem_region_count - returns the number of regions in use
+ */
+int mem_region_count(void) {
+    return __atomic_load_n(&num_regions, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * mem_region_of - returns the index of the region whose reserved address
+ *    space contains addr, or -1 if it lies in none.  Only the fixed
+ *    bounds of the reservations are read, so that other threads may move
+ *    the breaks meanwhile.  Callers check addr against mem_region_hi
+ *    when it must lie below the break.
+ */
+int mem_region_of(const void *addr) {
+    const unsigned char *a = (const unsigned char *) addr;
+    int n = __atomic_load_n(&num_regions, __ATOMIC_ACQUIRE);
+    int r;
+    for (r = 0; r < n; r++) {
+        if (a >= regions[r].lo && a < regions[r].max_addr)
+            return r;
+    }
+    return -1;
+}
+
+/*
+ * mem_region_sbrk - mem_sbrk for a single region
+ */
+void *mem_region_sbrk(int region, intptr_t incr) {
+    mem_region_t *rp = &regions[region];
+    unsigned char *old_brk = rp->brk;
 
     bool ok = true;
     if (incr < 0) {
+        if (rp->lo - rp->brk > incr) {
+            ok = false;
+            fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld below its start\n", (long) -incr);
+        }
+    } else if (rp->brk + incr > rp->max_addr) {
         ok = false;
-        fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
-    } else if (mem_brk + incr > mem_max_addr) {
-        ok = false;
-        size_t alloc = mem_brk - heap + incr;
+        size_t alloc = rp->brk - rp->lo + incr;
         fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
-    } else if (!sparse && sbrk(incr) == (void*) -1) {
-        ok = false;
-        fprintf(stderr, "ERROR: mem_sbrk failed.  Could not allocate more heap space\n");
     }
 
     if (ok) {
-        mem_brk += incr;
+        rp->brk += incr;
+        if (incr > 0 && !region_commit(rp)) {
+            rp->brk = old_brk;
+            fprintf(stderr, "ERROR: mem_sbrk failed.  Could not commit more heap space\n");
+            errno = ENOMEM;
+            return (void *) -1;
+        }
+        if (incr < 0)
+            region_decommit(rp);
+        if (rp->brk > rp->peak_brk)
+            rp->peak_brk = rp->brk;
+        if (rp->brk > rp->clean_brk)
+            rp->clean_brk = rp->brk;
+        if (incr > 0)
+            __atomic_add_fetch(&sbrk_count, 1, __ATOMIC_RELAXED);
+        heap_add(incr);
         return (void *) old_brk;
     } else {
         errno = ENOMEM;
@@ -195,24 +414,194 @@ void *mem_sbrk(intptr_t incr) {
 }
 
 /*
- * mem_heap_lo - return address of the first heap byte
+ * mem_mmap - map len bytes, rounded up to MEM_MAP_ALIGN, outside of the
+ *    heap regions.  Returns the MEM_MAP_ALIGN aligned start of the mapping,
+ *    or (void *) -1 on failure.
  */
-void *mem_heap_lo(){
-    return (void *) heap;
+void *mem_mmap(size_t len) {
+    unsigned char *addr = NULL;
+
+    if (len == 0 || len > SIZE_MAX - MEM_MAP_ALIGN) {
+        errno = ENOMEM;
+        return (void *) -1;
+    }
+    len = (len + MEM_MAP_ALIGN - 1) & ~((size_t) MEM_MAP_ALIGN - 1);
+
+    if (!sparse) {
+        addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            fprintf(stderr, "ERROR: mem_mmap failed.  Could not map %zu bytes\n", len);
+            errno = ENOMEM;
+            return (void *) -1;
+        }
+    }
+
+    map_lock();
+    if (sparse && (addr = map_place(len)) == NULL) {
+        map_unlock();
+        fprintf(stderr, "ERROR: mem_mmap failed.  Ran out of mapping space for %zu bytes\n", len);
+        errno = ENOMEM;
+        return (void *) -1;
+    }
+
+    map_insert(addr, len);
+    map_unlock();
+
+    heap_add(len);
+    return (void *) addr;
 }
 
-/* 
- * mem_heap_hi - return address of last heap byte
+/*
+ * mem_munmap - release a mapping returned by mem_mmap.  len must be the
+ *    length it was mapped with.  Returns 0, or -1 if addr is not mapped.
  */
-void *mem_heap_hi(){
-    return (void *)(mem_brk - 1);
+int mem_munmap(void *addr, size_t len) {
+    map_lock();
+    size_t i = map_find(addr);
+    if (i == num_mappings || mappings[i].addr != addr ||
+        (len + MEM_MAP_ALIGN - 1) / MEM_MAP_ALIGN != mappings[i].len / MEM_MAP_ALIGN) {
+        map_unlock();
+        fprintf(stderr, "ERROR: mem_munmap failed.  No mapping of %zu bytes at %p\n", len, addr);
+        errno = EINVAL;
+        return -1;
+    }
+
+    len = mappings[i].len;
+    map_remove(i);
+    if (sparse)
+        pages_free(addr, len);
+    map_unlock();
+
+    if (!sparse)
+        munmap(addr, len);
+    heap_add(-(intptr_t) len);
+    return 0;
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_mremap - resize a mapping returned by mem_mmap to new_len bytes,
+ *    rounded up to MEM_MAP_ALIGN, without copying its contents.  old_len
+ *    must be the length it was mapped with.  The mapping grows in place if
+ *    possible and moves otherwise.  Returns the start of the resized
+ *    mapping, or (void *) -1 on failure, leaving the old mapping intact.
  */
-size_t mem_heapsize() {
-    return (size_t)(mem_brk - heap);
+void *mem_mremap(void *old_addr, size_t old_len, size_t new_len) {
+    unsigned char *addr = NULL;
+
+    if (new_len == 0 || new_len > SIZE_MAX - MEM_MAP_ALIGN) {
+        errno = ENOMEM;
+        return (void *) -1;
+    }
+    new_len = (new_len + MEM_MAP_ALIGN - 1) & ~((size_t) MEM_MAP_ALIGN - 1);
+
+    map_lock();
+    size_t i = map_find(old_addr);
+    if (i == num_mappings || mappings[i].addr != old_addr ||
+        (old_len + MEM_MAP_ALIGN - 1) / MEM_MAP_ALIGN != mappings[i].len / MEM_MAP_ALIGN) {
+        map_unlock();
+        fprintf(stderr, "ERROR: mem_mremap failed.  No mapping of %zu bytes at %p\n",
+                old_len, old_addr);
+        errno = EINVAL;
+        return (void *) -1;
+    }
+    old_len = mappings[i].len;
+    /* End of the gap above the mapping in the sparse mapping space */
+    unsigned char *gap_end = (i + 1 < num_mappings) ? mappings[i + 1].addr : map_hi;
+
+    if (!sparse) {
+        addr = mremap(old_addr, old_len, new_len, MREMAP_MAYMOVE);
+        if (addr == MAP_FAILED) {
+            map_unlock();
+            fprintf(stderr, "ERROR: mem_mremap failed.  Could not remap %zu bytes\n", new_len);
+            errno = ENOMEM;
+            return (void *) -1;
+        }
+    } else if (new_len <= (size_t) (gap_end - mappings[i].addr)) {
+        /* Shrink, or grow into the gap above, in place */
+        addr = old_addr;
+        if (new_len < old_len)
+            pages_free(mappings[i].addr + new_len, old_len - new_len);
+    } else {
+        if ((addr = map_place(new_len)) == NULL) {
+            map_unlock();
+            fprintf(stderr, "ERROR: mem_mremap failed.  Ran out of mapping space for %zu bytes\n",
+                    new_len);
+            errno = ENOMEM;
+            return (void *) -1;
+        }
+        pages_move(old_addr, addr, old_len);
+    }
+
+    if (addr == old_addr) {
+        mappings[i].len = new_len;
+    } else {
+        map_remove(i);
+        map_insert(addr, new_len);
+    }
+    map_unlock();
+
+    heap_add((intptr_t) new_len - (intptr_t) old_len);
+    return (void *) addr;
+}
+
+/*
+ * mem_is_mapped - does [addr, addr+len) lie within one mapping of mem_mmap?
+ */
+bool mem_is_mapped(const void *addr, size_t len) {
+    const unsigned char *a = (const unsigned char *) addr;
+    map_lock();
+    size_t i = map_find(addr);
+    bool mapped = i < num_mappings &&
+        (size_t) (a - mappings[i].addr) < mappings[i].len &&
+        len <= mappings[i].len - (size_t) (a - mappings[i].addr);
+    map_unlock();
+    return mapped;
+}
+
+/*
+ * mem_region_lo - return address of the first byte of a region
+ */
+void *mem_region_lo(int region) {
+    return (void *) regions[region].lo;
+}
+
+/*
+ * mem_region_hi - return address of the last byte of a region
+ */
+void *mem_region_hi(int region) {
+    return (void *) (regions[region].brk - 1);
+}
+
+/*
+ * mem_region_size - returns the size of a region in bytes
+ */
+size_t mem_region_size(int region) {
+    return (size_t) (regions[region].brk - regions[region].lo);
+}
+
+/*
+ * mem_region_peak - returns the largest size of a region since the last reset
+ */
+size_t mem_region_peak(int region) {
+    return (size_t) (regions[region].peak_brk - regions[region].lo);
+}
+
+/*
+ * mem_region_clean - return the address from which the memory of a region
+ *    is known to read as zero: its highest break since it was mapped, as
+ *    mem_reset_brk doesn't clear memory.  Sparse pages are recycled
+ *    without clearing, so in sparse mode no memory is known to be zero.
+ */
+void *mem_region_clean(int region) {
+    return sparse ? regions[region].max_addr : regions[region].clean_brk;
+}
+
+/*
+ * mem_map_clean - does memory fresh from mem_mmap read as zero?
+ */
+bool mem_map_clean(void) {
+    return !sparse;
 }
 
 /*
@@ -241,8 +630,7 @@ void mem_write128(void* addr, __int128 val)
 /* Read len bytes and return value zero-extended to 64 bits */
 uint64_t mem_read(const void *addr, size_t len) {
     uint64_t rdata;
-    if (sparse &&
-            (unsigned char *) addr >= heap && (unsigned char *) addr+len <= mem_brk) {
+    if (sparse && in_heap(addr, len)) {
         /* Heap read.  Check if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, false);
@@ -279,8 +667,7 @@ uint64_t mem_read(const void *addr, size_t len) {
 
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len) {
-    if (sparse &&
-            (unsigned char *) addr >= heap && (unsigned char *) addr+len <= mem_brk) {
+    if (sparse && in_heap(addr, len)) {
         /* Heap write.  Check to see if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, true);
@@ -361,12 +748,13 @@ void hprobe(void *ptr, int offset, size_t count) {
     unsigned char *cptr_lo = cptr+offset;
     unsigned char *cptr_hi = cptr_lo + count - 1;
     unsigned char *iptr;
-    if ((void *) cptr_lo < mem_heap_lo()) {
-        fprintf(stderr, "Invalid probe.  Address %p is below start of heap\n",
+    int r = mem_region_of(cptr_lo);
+    if (r < 0) {
+        fprintf(stderr, "Invalid probe.  Address %p is outside of the heap\n",
                 cptr_lo);
         return;
     }
-    if ((void *) cptr_hi > mem_heap_hi()) {
+    if ((void *) cptr_hi > mem_region_hi(r)) {
         fprintf(stderr, "Invalid probe.  Address %p is beyond end of heap\n",
                 cptr_lo);
         return;
@@ -393,14 +781,206 @@ static void print_stats() {
         size_t ppages = num_pages - num_free_pages;
         size_t pbytes = ppages * SPARSE_PAGE_SIZE;
         printf("Allocated %zu/%zu pages (%zu bytes) to cover %zu heap bytes (%.4f%% density).  Max address = %p\n",
-                ppages, num_pages, pbytes, vbytes, 100.0 * pbytes / vbytes, mem_brk);
+                ppages, num_pages, pbytes, vbytes, 100.0 * pbytes / vbytes, regions[0].brk);
     } else {
         printf("Allocated %zu heap bytes.  Max address = %p\n",
-                vbytes, mem_brk);
+                vbytes, regions[0].brk);
     }
     stats_printed = true;
 }
 
+/* Does the access [addr, addr+len) lie within a heap region or a live
+ * sparse mapping? */
+static bool in_heap(const void *addr, size_t len) {
+    const unsigned char *a = (const unsigned char *) addr;
+    int r;
+    for (r = 0; r < num_regions; r++) {
+        if (a >= regions[r].lo && a + len <= regions[r].brk)
+            return true;
+    }
+    return a >= map_lo && a < map_hi && mem_is_mapped(addr, len);
+}
+
+/* Protection of the reservation of a dense region */
+static int region_prot(void) {
+    return MEM_LAZY_COMMIT ? PROT_NONE : PROT_WRITE;
+}
+
+/* Commit the memory of a dense region up to its break, in steps of
+ * MEM_COMMIT_STEP.  Returns false if mprotect fails */
+static bool region_commit(mem_region_t *rp) {
+    if (sparse || rp->brk <= rp->commit_brk)
+        return true;
+
+    size_t steps = (rp->brk - rp->lo + MEM_COMMIT_STEP - 1) / MEM_COMMIT_STEP;
+    unsigned char *commit_brk = rp->lo + steps * MEM_COMMIT_STEP;
+    if (commit_brk > rp->max_addr)
+        commit_brk = rp->max_addr;
+    if (mprotect(rp->commit_brk, commit_brk - rp->commit_brk, PROT_READ | PROT_WRITE) != 0)
+        return false;
+    rp->commit_brk = commit_brk;
+    return true;
+}
+
+/* Decommit the memory of a dense region more than one MEM_COMMIT_STEP
+ * beyond its break, so that a heap shrinking and regrowing around a
+ * step boundary doesn't fault in the same pages over and over */
+static void region_decommit(mem_region_t *rp) {
+    if (sparse || !MEM_LAZY_COMMIT)
+        return;
+
+    size_t steps = (rp->brk - rp->lo + MEM_COMMIT_STEP - 1) / MEM_COMMIT_STEP + 1;
+    unsigned char *keep = rp->lo + steps * MEM_COMMIT_STEP;
+    if (keep >= rp->commit_brk)
+        return;
+    madvise(keep, rp->commit_brk - keep, MADV_DONTNEED);
+    mprotect(keep, rp->commit_brk - keep, PROT_NONE);
+    rp->commit_brk = keep;
+    /* Pages dropped by MADV_DONTNEED come back zero filled */
+    if (rp->clean_brk > keep)
+        rp->clean_brk = keep;
+}
+
+/* Add incr bytes to the heap size and update its peak */
+static void heap_add(intptr_t incr) {
+    size_t total = __atomic_add_fetch(&heap_total, incr, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+    while (total > peak &&
+           !__atomic_compare_exchange_n(&heap_peak, &peak, total, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* Take the lock of the mapping table, which threads may share */
+static void map_lock(void) {
+    while (__atomic_test_and_set(&map_locked, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+/* Release the lock of the mapping table */
+static void map_unlock(void) {
+    __atomic_clear(&map_locked, __ATOMIC_RELEASE);
+}
+
+/* Index of the last mapping starting at or below addr, or num_mappings
+ * if there is none.  The mapping table lock must be held */
+static size_t map_find(const void *addr) {
+    const unsigned char *a = (const unsigned char *) addr;
+    size_t lo = 0, hi = num_mappings;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (mappings[mid].addr <= a)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo == 0 ? num_mappings : lo - 1;
+}
+
+/* Add a mapping to the table, keeping it sorted by address.  The mapping
+ * table lock must be held */
+static void map_insert(unsigned char *addr, size_t len) {
+    if (num_mappings == max_mappings) {
+        size_t new_max = max_mappings ? 2 * max_mappings : 64;
+        mem_mapping_t *new_mappings = realloc(mappings, new_max * sizeof(mem_mapping_t));
+        if (new_mappings == NULL) {
+            fprintf(stderr, "FAILURE.  realloc couldn't grow the mapping table\n");
+            exit(1);
+        }
+        mappings = new_mappings;
+        max_mappings = new_max;
+    }
+
+    size_t i = num_mappings;
+    while (i > 0 && mappings[i - 1].addr > addr) {
+        mappings[i] = mappings[i - 1];
+        i--;
+    }
+    mappings[i].addr = addr;
+    mappings[i].len = len;
+    num_mappings++;
+}
+
+/* Drop mapping i from the table.  The mapping table lock must be held */
+static void map_remove(size_t i) {
+    num_mappings--;
+    for (; i < num_mappings; i++)
+        mappings[i] = mappings[i + 1];
+}
+
+/* Start of the first gap of the sparse mapping space that holds len
+ * bytes, or NULL if there is none.  The mapping table lock must be held */
+static unsigned char *map_place(size_t len) {
+    unsigned char *lo = map_lo;
+    size_t i;
+    for (i = 0; i < num_mappings; i++) {
+        if ((size_t) (mappings[i].addr - lo) >= len)
+            return lo;
+        lo = mappings[i].addr + mappings[i].len;
+    }
+    return (size_t) (map_hi - lo) >= len ? lo : NULL;
+}
+
+/* Give the emulated pages of [addr, addr+len) back to the free pages.
+ * addr must be page aligned */
+static void pages_free(const unsigned char *addr, size_t len) {
+    size_t lo = page_id(addr);
+    size_t hi = page_id(addr + len);
+    size_t n = (hi - lo < num_buckets) ? hi - lo : num_buckets;
+    size_t k;
+
+    /* The pages of the range hash to these buckets */
+    for (k = 0; k < n; k++) {
+        mem_block_t **link = &page_table[(lo + k) % num_buckets];
+        while (*link) {
+            mem_block_t *block = *link;
+            if (block->id >= lo && block->id < hi) {
+                *link = block->next;
+                block->next = free_pages;
+                free_pages = block;
+                num_free_pages++;
+            } else {
+                link = &block->next;
+            }
+        }
+    }
+}
+
+/* Give the emulated pages of [old_addr, old_addr+len) the IDs of the same
+ * offsets from new_addr.  Both addresses must be page aligned */
+static void pages_move(const unsigned char *old_addr, const unsigned char *new_addr,
+                       size_t len) {
+    size_t lo = page_id(old_addr);
+    size_t hi = page_id(old_addr + len);
+    size_t new_lo = page_id(new_addr);
+    mem_block_t *moved = NULL;
+    size_t b;
+
+    /* Unlink the pages first, so that none is visited twice */
+    for (b = 0; b < num_buckets; b++) {
+        mem_block_t **link = &page_table[b];
+        while (*link) {
+            mem_block_t *block = *link;
+            if (block->id >= lo && block->id < hi) {
+                *link = block->next;
+                block->next = moved;
+                moved = block;
+            } else {
+                link = &block->next;
+            }
+        }
+    }
+
+    while (moved) {
+        mem_block_t *block = moved;
+        moved = block->next;
+        block->id = block->id - lo + new_lo;
+        b = block->id % num_buckets;
+        block->next = page_table[b];
+        page_table[b] = block;
+    }
+}
+
 /* Given an address, compute the ID  of its page */
 static size_t page_id(const void *addr) {
     size_t offset = (unsigned char *) addr - (unsigned char *) SPARSE_HEAP_START;
@@ -434,7 +1014,12 @@ static void *get_mem(const void *addr, size_t size, bool isWrite) {
             fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
             exit(1);
         }
-        block = next_free_page++;
+        if (free_pages) {
+            block = free_pages;
+            free_pages = block->next;
+        } else {
+            block = next_free_page++;
+        }
         num_free_pages--;
         block->id = id;
         block->next = page_table[b];
@@ -9,8 +9,32 @@ void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_heap_peak(void);
+size_t mem_sbrk_count(void);
 size_t mem_pagesize(void);
 
+/* Functions for allocators managing several heap regions.  Region 0 is the
+ * heap extended by mem_sbrk; mem_heapsize reports the total of all regions */
+#define MEM_MAX_REGIONS 8
+int mem_region_new(void);
+int mem_region_count(void);
+int mem_region_of(const void *addr);
+void *mem_region_sbrk(int region, intptr_t incr);
+void *mem_region_lo(int region);
+void *mem_region_hi(int region);
+size_t mem_region_size(int region);
+size_t mem_region_peak(int region);
+void *mem_region_clean(int region);
+
+/* Functions for memory mapped outside of the heap regions.  Mappings are
+ * aligned to and sized in multiples of MEM_MAP_ALIGN bytes */
+#define MEM_MAP_ALIGN 4096
+void *mem_mmap(size_t len);
+int mem_munmap(void *addr, size_t len);
+void *mem_mremap(void *old_addr, size_t old_len, size_t new_len);
+bool mem_is_mapped(const void *addr, size_t len);
+bool mem_map_clean(void);
+
 /* Functions used for memory emulation */
 
 /* Read len bytes and return value zero-extended to 64 bits */
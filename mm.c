@@ -15,9 +15,12 @@
  * is allocated, and the alloc status of block.
  * 
  * Free blocks in the heap are categorized as either small blocks (16 bytes)
- * or normal blocks (> 16 bytes). Small blocks are stored in a list pointed 
- * to by small_blocks_list and contain only a header and a pointer to next 
- * small block. Normal blocks are stored in one of the thirteen free lists, 
+ * or normal blocks (> 16 bytes). Small blocks are stored in a doubly linked
+ * list pointed to by small_blocks_list and contain only a header and two
+ * 32-bit offsets of the next and previous small blocks, counted in 16-byte
+ * units from heap_start. Small blocks too far from heap_start to be encoded
+ * (beyond 64 GiB) are not listed and are only reclaimed by coalescing.
+ * Normal blocks are stored in one of the thirteen free lists, 
  * each pointed to by an element in free_lists array. The first list contains 
  * blocks of size in range [2^4, 2^5). The second list contains blocks of 
  * size in range [2^5, 2^6), so on until the 12th list. The 13th list holds 
@@ -25,6 +28,130 @@
  * both header and footer, plus prev/next pointers to adjacent blocks in 
  * the free list. 
  * 
+ * The last size class is not a list but a splay tree ordered by block size,
+ * then address, so that large requests get the best fit in logarithmic
+ * amortized time. Its blocks store left/right/parent pointers in place of
+ * prev/next, and free_list[tree_class] points to the tree root.
+ * 
+ * When built with TLSF_INDEX=1, the free lists are instead indexed as a
+ * two-level segregated fit: each power of two range is split into eight 
+ * linear sub-classes, and two bitmaps (one bit per power of two, one bit
+ * per sub-class) locate the next non-empty list in constant time.
+ * 
+ * Requests of at most 128 bytes are served by a slab layer (SLAB_ALLOC)
+ * when their slot is smaller than their heap block would be, that is when
+ * the size is a multiple of 16 or more than 8 bytes past one. The other 
+ * small sizes fill a heap block as well as a slot and go to the heap. A 
+ * class gets its first page only after slab_min_demand requests, which 
+ * the heap serves, so a few small blocks don't each pin a page. 
+ * A slab page is an ordinary allocated block of 1 KiB whose payload is 
+ * 1 KiB aligned. The payload starts with a page header (free slot bitmap,
+ * object size and page list links), followed by header-less slots of one
+ * size class (16 to 128 bytes in 16-byte steps). free finds the page of a
+ * pointer by rounding it down to 1 KiB, and a bitmap with one bit per 
+ * 1 KiB page of the heap, set while the page is a slab page, tells slab 
+ * pages apart from ordinary payload. The bitmap is split in chunks that 
+ * are allocated in the heap as it grows. The heads of the page lists of
+ * each class and the bitmap chunks are kept in the arena state, in front
+ * of the prologue. Pages with free slots are linked in their class list.
+ * An empty page is returned to the free lists, so that its memory can 
+ * coalesce with neighboring blocks, unless it is the only page of its 
+ * class with free slots. That page is kept, so that a malloc and free 
+ * pair at a page boundary doesn't carve a new page every time, until the
+ * free lists have no fit and the quick lists are emptied.
+ * 
+ * Freed blocks of the 24 sizes above the slab sizes (144 to 512 bytes)
+ * first go to a quick list of their exact size (QUICK_LISTS), where they
+ * stay marked allocated so that neither coalescing nor the boundary tags
+ * of their neighbors notice them. malloc takes a block of the exact size
+ * from its quick list before searching the free lists. Quick lists hold a
+ * bounded number of blocks each, and are emptied into the free lists, 
+ * with coalescing, when the free lists have no fit and before the heap 
+ * is extended.
+ * 
+ * The free lists, small list, quick lists and slab lists form an arena,
+ * whose state sits at the start of its heap region in front of the 
+ * prologue. The default build has one arena in the main heap.
+ * 
+ * When built with THREAD_SAFE=1, every heap operation holds the lock of 
+ * its arena, and each thread keeps a small cache of freed blocks per 
+ * 16-byte size bin (tcache) in front of it. A malloc that hits the cache,
+ * and a free that finds room in it, take no lock. Cached blocks stay 
+ * allocated in the heap and are freed to it when the thread exits. With
+ * MM_ARENAS > 1, threads are assigned round-robin to that many arenas, 
+ * each in its own memlib heap region, so threads of different arenas 
+ * don't contend. A block is freed to the arena whose region holds it. 
+ * Blocks freed by threads of another arena are pushed on a lock-free 
+ * remote free stack of their arena, which the next malloc on the arena
+ * drains under its lock.
+ * mm_init must not run concurrently with other calls, and drops the 
+ * caches of all threads.
+ * 
+ * The heap grows by at least chunksize. Extensions that follow each other
+ * within a few allocations double the growth step, so that allocation 
+ * bursts need few sbrk calls, and a quiet phase resets it. What an 
+ * extension adds beyond the request is capped by 1/32 of the heap size,
+ * which bounds the memory growth can leave unused.
+ * 
+ * When a free leaves a free block larger than the trim threshold at the
+ * end of the heap, the block is cut down to half the threshold and the 
+ * rest of the heap is returned to memlib with a negative sbrk.
+ * 
+ * Requests of at least the mmap threshold are not carved from the heap but
+ * get a mapping of their own from mem_mmap, which free hands back with 
+ * mem_munmap, so that a long-lived huge block can't pin the heap below it.
+ * A mapped block has its header right before the payload, 16 bytes into
+ * the page aligned mapping, with the mapped bit set, and the mapping 
+ * length is kept in the first word of the mapping.
+ * No heap block sets that bit, and only mapped payloads start 16 bytes 
+ * into a page, so free recognizes them without a lookup. realloc resizes
+ * mapped blocks that stay above the threshold with mem_mremap, which moves
+ * their pages instead of copying the payload.
+ * 
+ * memalign, posix_memalign and aligned_alloc serve alignments above 16 
+ * bytes from a fit with room for the alignment. The slack before the 
+ * aligned payload becomes a free block of its own and the excess after it
+ * is split off, so only the alignment padding that no block can use is 
+ * lost. Mapped blocks start 16 bytes into a page, so aligned requests are
+ * always carved from the heap.
+ * 
+ * mm_usable_size reports what a block can hold: its payload, its slot 
+ * size or the rest of its mapping. mm_try_expand grows a block only in 
+ * place, with the growth path of realloc, so a caller can try it before a
+ * realloc that would move the block. It never shrinks a block, so a probe
+ * with a size the block already holds gives nothing back to the heap.
+ * 
+ * mm_free_sized and mm_realloc_sized take the size a block was last 
+ * requested with. A heap block always has the adjusted size of its last 
+ * request, so the size picks its quick list or cache bin without reading
+ * the header, and a size above slab_max_size rules out a slab object, so 
+ * the slab page of the pointer isn't probed.
+ * 
+ * mm_malloc_batch allocates a group of same-size blocks under one lock. 
+ * After the exact-size quick list, it carves as many blocks as fit from 
+ * each fitting free block in a single pass, and splits off the rest once.
+ * mm_free_batch sorts the pointers by address, so that a run of adjacent
+ * blocks is merged and coalesced with its neighbors as one free block.
+ * 
+ * mm_get_stats reports the free memory of the heap without walking it. 
+ * Each arena counts the free blocks and bytes of each power of two size
+ * class as blocks enter and leave the free lists, so a snapshot sums a 
+ * few counters per arena. The largest free block comes from the rightmost
+ * node of the splay tree, which the tree caches, or else from the maximum
+ * of the last non-empty class. That maximum is only lowered when its 
+ * class empties, so below 64 KiB the size may be an upper bound.
+ * 
+ * When built with MM_INSTRUMENT=1, each arena counts its fit searches 
+ * with a histogram of the free blocks they inspect, the four cases of 
+ * coalesce_block, and the blocks split_block splits or leaves whole, 
+ * for mm_get_instrument. Other builds compile the counting out.
+ * 
+ * calloc only clears what may be dirty. Memory that memlib has never 
+ * handed out, above the highest break of the region, and fresh mappings 
+ * read as zero. When malloc extends the heap or maps a block, it records
+ * where the returned block turns clean, and calloc clears the payload up
+ * to there, the free block links and the footer that extend_heap wrote.
+ * 
  * When allocator performs malloc, realloc or calloc, it goes through 
  * small_blocks_list and free_lists to find a free block of appropriate 
  * size using first-fit approach. When free is called, the allocator first
@@ -53,13 +180,25 @@
  *   -----------------------------------------------------------------
  *  |Header:  block size | prev_small bit | prev_alloc bit| alloc bit|
  *  |----------------------------------------------------------------|
- *  | next: pointer to next free block in small_block_list           |
+ *  | next: offset of next block     | prev: offset of prev block    |
+ *  ------------------------------------------------------------------
+ * 
+ *  Slab page structure (payload of a 1 KiB allocated block)
+ *   -----------------------------------------------------------------
+ *  |Header:  block size 1024 | prev_small bit | prev_alloc bit | 1   |
+ *  |----------------------------------------------------------------|
+ *  | free slot bitmap              | next page                      |
+ *  |----------------------------------------------------------------|
+ *  | prev page                     | object size    | used slots    |
+ *  |----------------------------------------------------------------|
+ *  | slot 0 | slot 1 | ...                                          |
  *  ------------------------------------------------------------------
  *                                                                            *
  ******************************************************************************
  */
 
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -69,6 +208,10 @@
 #include <unistd.h>
 #include <inttypes.h>
 
+#if THREAD_SAFE
+#include <pthread.h>
+#endif
+
 #include "mm.h"
 #include "memlib.h"
 
@@ -80,6 +223,9 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
 #define memset mem_memset
 #define memcpy mem_memcpy
 #endif /* def DRIVER */
@@ -111,11 +257,95 @@
 #define dbg_printheap(...)  ((void) sizeof(__VA_ARGS__))
 #endif
 
-// Total number of free lists
-#define FREE_LIST_SIZE 13
+// Use two-level segregated fit (TLSF) free list index
+#ifndef TLSF_INDEX
+#define TLSF_INDEX 0
+#endif
 
 // Min size class is 16, 2^4
 #define MIN_SIZE_CLASS 4
+
+// Serve small requests from slab pages
+#ifndef SLAB_ALLOC
+#define SLAB_ALLOC 1
+#endif
+
+// Number of slab size classes, 16 to 128 bytes in 16-byte steps
+#define SLAB_CLASSES 8
+
+// Number of chunks of the slab page bitmap, which cover 1 GiB of heap
+#define SLAB_MAP_CHUNKS 12
+
+// Keep freed small blocks in exact-size quick lists and coalesce them later
+#ifndef QUICK_LISTS
+#define QUICK_LISTS 1
+#endif
+
+// Number of quick lists, one per 16 bytes of block size
+#define QUICK_BINS 24
+
+// Blocks held by each quick list
+#define QUICK_COUNT 16
+
+// Serialize the heap with a lock and add per-thread caches
+#ifndef THREAD_SAFE
+#define THREAD_SAFE 0
+#endif
+
+// Number of per-thread cache bins, one per 16 bytes of block size
+#define TCACHE_BINS 64
+
+// Cache bins in all, with one more per slab class for heap blocks of that
+// size, which hold less than a slot of the same size
+#define TCACHE_ALL_BINS (TCACHE_BINS + SLAB_CLASSES)
+
+// Blocks held by each per-thread cache bin
+#define TCACHE_COUNT 7
+
+// Default size of the free block at the end of the heap above which free
+// gives memory back to memlib (see mm_set_trim_threshold)
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (1 << 17)
+#endif
+
+// Default request size from which malloc maps a block of its own instead 
+// of using the heap (see mm_set_mmap_threshold)
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (1 << 18)
+#endif
+
+// Count fit search probes, coalesce cases and splits (see mm_get_instrument)
+#ifndef MM_INSTRUMENT
+#define MM_INSTRUMENT 0
+#endif
+
+// Number of independent arenas threads are spread over
+#ifndef MM_ARENAS
+#define MM_ARENAS 1
+#endif
+
+#if MM_ARENAS > 1 && !THREAD_SAFE
+#error "MM_ARENAS > 1 requires THREAD_SAFE"
+#endif
+
+#if MM_ARENAS > MEM_MAX_REGIONS
+#error "MM_ARENAS exceeds the number of heap regions of memlib"
+#endif
+
+#if TLSF_INDEX
+// Number of linear sub-classes per power of two is 2^SL_BITS
+#define SL_BITS 3
+#define SL_COUNT (1 << SL_BITS)
+
+// First level classes cover sizes up to 2^63
+#define FL_COUNT (64 - (MIN_SIZE_CLASS + SL_BITS) + 1)
+
+// Total number of free lists
+#define FREE_LIST_SIZE (FL_COUNT * SL_COUNT)
+#else
+// Total number of free lists
+#define FREE_LIST_SIZE 13
+#endif
 /* Basic constants */
 
 typedef uint64_t word_t;
@@ -123,12 +353,51 @@ typedef uint64_t word_t;
 // Word and header size (bytes)
 static const size_t wsize = sizeof(word_t);
 
-// Double word size (bytes)
-static const size_t dsize = 2 * wsize;
+// Payload alignment and minimum block size (bytes)
+static const size_t dsize = 16;
 
 // Minimum heap extend size each time an extend request is made (byte)
 static const size_t chunksize = (1 << 12);
 
+// Heap allocations between two extensions below which the growth step doubles
+static const size_t grow_window = 64;
+
+// Growth beyond the request is capped by heap size / grow_budget
+static const size_t grow_budget = 32;
+
+// Size and alignment of a slab page, including its block header (bytes)
+static const size_t slab_page_size = (1 << 10);
+
+// Largest request served by the slab layer (bytes)
+static const size_t slab_max_size = SLAB_CLASSES * 16;
+
+#if QUICK_LISTS
+// Smallest block size kept in a quick list, smaller ones are slab sizes
+static const size_t quick_min_size = SLAB_ALLOC ? slab_max_size + 16 : 16;
+#endif
+
+// Pages covered by the first chunk of the slab page bitmap
+static const size_t slab_map_base = 512;
+
+// Requests a slab class serves from the heap before it gets a first page
+static const uint8_t slab_min_demand = 32;
+
+// Size class whose free blocks are kept in a size-ordered splay tree
+static const int tree_class = FREE_LIST_SIZE - 1;
+
+// Fitting blocks compared by the MM_FIT_BEST_OF_N policy
+static const size_t fit_candidates = 8;
+
+// Longest range of pointers that mm_free_batch sorts by insertion
+static const size_t sort_insertion_max = 16;
+
+// Blocks probed in the closest size class before moving to a larger one
+#if TLSF_INDEX
+static const size_t class_probes = 1;
+#else
+static const size_t class_probes = SIZE_MAX;
+#endif
+
 // Mask to get block allocation status from header/footer
 static const word_t alloc_mask = 0x1;
 
@@ -138,6 +407,9 @@ static const word_t prev_alloc_mask = 0x2;
 // Mask to get indication if previous block is min size (16 bytes)
 static const word_t prev_small_mask = 0x4;
 
+// Mask to get indication if the block has a mapping of its own
+static const word_t mapped_mask = 0x8;
+
 // Mask to get block size from header/footer
 static const word_t size_mask = ~(word_t)0xF;
 
@@ -159,8 +431,7 @@ typedef struct block
     
     /*
      * The struct link_t contains two pointers to next and previous free block  
-     * in free lists. For small free blocks (16 bytes), only next is used to 
-     * indicate next free block in small free list.
+     * in free lists. 
      * 
      */
     struct link_t
@@ -169,6 +440,30 @@ typedef struct block
         struct block* prev;
 
     } link;
+
+    /*
+     * The struct small_link_t contains the offsets of next and previous 
+     * small free blocks (16 bytes) in small free list, so that both fit in 
+     * the single word after the header. Offset 0 stands for no block.
+     */
+    struct small_link_t
+    {
+        uint32_t next;
+        uint32_t prev;
+
+    } small;
+
+    /*
+     * The struct tree_node_t contains the child and parent pointers of a
+     * block in the splay tree of the largest size class.
+     */
+    struct tree_node_t
+    {
+        struct block* left;
+        struct block* right;
+        struct block* parent;
+
+    } node;
     
     // Zero-length array to store payload
     char payload[0];
@@ -182,33 +477,296 @@ typedef struct block
      */
 } block_t;
 
+/* 
+ * Header of a slab page, at the start of the payload of a 1 KiB aligned
+ * allocated block. Slots of obj_size bytes follow the header.
+ */
+typedef struct slab_page
+{
+    // Bit i is set when slot i is free
+    uint64_t free_map;
+
+    // Pages of the same class with free slots
+    struct slab_page *next;
+    struct slab_page *prev;
+
+    uint32_t obj_size;
+    uint32_t used;
+
+    char slots[0];
+} slab_page_t;
+
+/* 
+ * State of one arena, kept at the start of its heap region in front of
+ * the prologue. The default build has a single arena in the main heap.
+ */
+typedef struct arena
+{
+    // Pointer to the first block in the arena heap
+    block_t *heap_start;
+
+    /* List of pointers to the first free blocks in each size class.
+     * First size class range is [2^4, 2^5). 
+     * Second size class range is [2^5, 2^6), and so on until 12th size class.
+     * The last, 13th size class, holds any blocks >= 2^16 in a splay tree.
+     * With TLSF_INDEX, size class fl * SL_COUNT + sl holds the sl-th linear 
+     * sub-range of power of two range fl (see get_size_class).
+     */ 
+    block_t *free_list[FREE_LIST_SIZE];
+
+#if TLSF_INDEX
+    // Bitmap of first level classes having a non-empty sub-class
+    uint64_t fl_map;
+
+    // Bitmaps of non-empty sub-classes for each first level class
+    uint8_t sl_map[FL_COUNT];
+#else
+    // Bitmap of non-empty size classes, bit i is set when free_list[i] != NULL
+    uint32_t free_list_map;
+#endif
+
+    /* 
+     * Pointer to the first small block (16 bytes). All blocks in this list
+     * have 16 bytes and are linked through small_link_t offsets.
+     */ 
+    block_t *small_blocks_list;
+
+    // Heads of the lists of slab pages with free slots, one per size class
+    slab_page_t *slab_lists[SLAB_CLASSES];
+
+    // Number of slab pages in use
+    size_t slab_pages;
+
+    // Requests of each slab class served by the heap, up to slab_min_demand
+    uint8_t slab_demand[SLAB_CLASSES];
+
+    /* 
+     * Bitmap of the slab pages, bit n is set while the 1 KiB page n pages
+     * past heap_start is a slab page. Chunk 0 covers the first 
+     * slab_map_base pages, chunk k > 0 the next slab_map_base << (k - 1)
+     * pages. Chunks are allocated in the heap when a page first needs 
+     * them, and are read without the lock.
+     */
+    uint64_t *slab_map[SLAB_MAP_CHUNKS];
+
+    /* 
+     * Number and total size of the free blocks of each mm_stats class, 
+     * kept up to date by insert_free_block and remove_block_link. The 
+     * maximum of a class is the largest block it held since it was last
+     * empty, so it can exceed the largest block still in the class.
+     */
+    uint32_t class_blocks[MM_STATS_CLASSES];
+    size_t class_bytes[MM_STATS_CLASSES];
+    size_t class_max[MM_STATS_CLASSES];
+
+    // Rightmost node of the splay tree, its largest free block
+    block_t *tree_max;
+
+#if MM_INSTRUMENT
+    // Hot path counters, and the blocks inspected by the current search
+    struct mm_instrument counters;
+    size_t probes;
+#endif
+
+#if QUICK_LISTS
+    /* 
+     * Quick list i holds freed blocks of size quick_min_size + 16 * i 
+     * that are still marked allocated, linked through their first payload
+     * word
+     */
+    block_t *quick_lists[QUICK_BINS];
+    uint8_t quick_counts[QUICK_BINS];
+#endif
+
+    /* 
+     * Start of the part of the block last returned by heap_malloc that is
+     * known to read as zero, except for its free block links and footer,
+     * or null when none is
+     */
+    char *zero_start;
+
+    // Growth step of the next heap extension, at least chunksize
+    size_t grow_step;
+
+    // Heap allocations since the last heap extension
+    size_t grow_ops;
+
+    // memlib heap region holding the arena
+    int region;
+
+#if THREAD_SAFE
+    // Lock taken by every operation on the arena that misses the thread cache
+    pthread_mutex_t lock;
+
+    /* 
+     * Stack of blocks freed by threads of other arenas, linked through 
+     * their first payload word. Pushed without the lock, and drained by
+     * the next malloc on the arena.
+     */
+    void *remote_free;
+#endif
+} arena_t;
 
-/* Global variables total size = 120 bytes */
+// Size of the arena state in front of the prologue, keeps payloads aligned
+static const size_t arena_size = (sizeof(arena_t) + 15) & ~(size_t) 15;
 
-// Pointer to the first block in heap
-static block_t *heap_start = NULL;
 
-/* List of pointers to the first free blocks in each size class.
- * First size class range is [2^4, 2^5). 
- * Second size class range is [2^5, 2^6), and so on until 12th size class.
- * The last, 13th size class, holds any blocks >= 2^16.
- */ 
-static block_t *free_list[FREE_LIST_SIZE];
+/* Global variables total size = 40 bytes (single-threaded build) */
+
+// Arena of the current heap operation
+#if THREAD_SAFE
+static __thread arena_t *arena = NULL;
+#else
+static arena_t *arena = NULL;
+#endif
+
+// Search policy of find_fit, one of MM_FIT_* (see mm_set_fit_policy)
+static int fit_policy = MM_FIT_FIRST;
+
+// Trailing free block size that triggers trim_heap, 0 never trims
+static size_t trim_threshold = TRIM_THRESHOLD;
+
+// Request size served by map_malloc, 0 never maps
+static size_t mmap_threshold = MMAP_THRESHOLD;
+
+#if THREAD_SAFE
+// Count of mm_init calls, used to drop per-thread caches filled from a 
+// previous heap
+static uint64_t heap_epoch = 0;
+#endif
 
+#if THREAD_SAFE
 /* 
- * Pointer to the first small block (16 bytes). All blocks in this list
- * have 16 bytes.
- */ 
-static block_t *small_blocks_list = NULL;
+ * Cache of freed blocks of one thread. Bin i holds up to TCACHE_COUNT 
+ * blocks or slab slots of size 16 * (i + 1), linked through their first
+ * payload word. Heap blocks of slab sizes hold 8 bytes less than a slot,
+ * so they go to bin TCACHE_BINS + i instead. Cached blocks stay allocated
+ * in the heap.
+ */
+typedef struct tcache
+{
+    void *bins[TCACHE_ALL_BINS];
+    uint8_t counts[TCACHE_ALL_BINS];
+
+    // heap_epoch of the heap the cached blocks belong to
+    uint64_t epoch;
+
+    // Arena the thread allocates from
+    arena_t *arena;
+} tcache_t;
+
+static __thread tcache_t tcache;
+
+// Arenas of the current heap, arena i lives in heap region i
+static arena_t *arenas[MM_ARENAS];
+static int arena_count = 0;
+
+// Next arena handed out by arena_assign
+static unsigned int arena_next = 0;
+
+// Lock serializing the creation of arenas
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Key whose destructor flushes a thread's cache when the thread exits
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+#endif
 
 /* Function prototypes for internal helper routines */
 
 bool mm_checkheap(int lineno);
 
+static void *heap_malloc(size_t size);
+static void *heap_memalign(size_t align, size_t size);
+static void heap_free(void *bp);
+static void heap_free_sized(void *bp, size_t size);
+static size_t heap_malloc_batch(size_t size, void **ptrs, size_t n);
+static void heap_free_batch(void **ptrs, size_t n);
+static void *heap_realloc(void *ptr, size_t old_size, size_t size);
+static bool heap_try_expand(void *bp, size_t size);
+static size_t copy_size(size_t payload, size_t old_size, size_t size);
+static void mm_lock(void);
+static void mm_unlock(void);
+static bool arena_init(int region);
+
+#if THREAD_SAFE
+static arena_t *arena_home(void);
+static arena_t *arena_assign(void);
+static arena_t *arena_of(void *bp);
+static void remote_push(void *bp);
+static void remote_drain(void);
+#endif
+
+#if THREAD_SAFE
+static int tcache_class(size_t size);
+static int tcache_block_class(void *bp);
+static void *tcache_get(size_t size);
+static bool tcache_put(void *bp, int i);
+static void tcache_reset(void);
+static void tcache_key_create(void);
+static void tcache_flush(void *arg);
+#endif
+
 static block_t *extend_heap(size_t size);
+static void trim_heap(block_t *block);
+static void release_block(block_t *block);
+static bool quick_put(block_t *block, size_t asize);
+static block_t *quick_get(size_t asize);
+static bool quick_flush(void);
+static size_t tail_free_size(void);
+static size_t grow_size(size_t need);
+static void *map_malloc(size_t size);
+static void map_free(block_t *block);
+static void *map_realloc(block_t *block, size_t size);
+static block_t *map_block_of(void *bp);
+static char *map_base(block_t *block);
+static size_t map_length(block_t *block);
 static block_t *find_fit(size_t asize);
+static block_t *search_class(int i, size_t asize, size_t max_probes);
+
+static bool tree_less(block_t *a, block_t *b);
+static void tree_insert(block_t *block);
+static void tree_remove(block_t *block);
+static block_t *tree_find_fit(size_t asize);
+static void tree_rotate_left(block_t *x);
+static void tree_rotate_right(block_t *x);
+static void tree_splay(block_t *x);
+static void tree_replace(block_t *u, block_t *v);
+static block_t *tree_min(block_t *u);
+static block_t *tree_rightmost(block_t *u);
+static block_t *tree_next(block_t *u);
+static int get_size_class(size_t size);
+static void set_class_map(int i);
+static void clear_class_map(int i);
+static bool get_class_map(int i);
+static int find_class_above(int i);
+static int get_stats_class(size_t size);
+static size_t largest_free_size(void);
+static void add_arena_stats(struct mm_stats *stats);
+static block_t *find_fit_block(size_t asize);
+static void add_arena_counters(struct mm_instrument *counters);
+static void count_probes(size_t probes);
+static void count_fit(block_t *block);
+static void count_coalesce(int c);
+static void count_split(bool split);
 static block_t *coalesce_block(block_t *block);
 static void split_block(block_t *block, size_t asize);
+static size_t carve_blocks(block_t *block, size_t asize, void **ptrs, size_t n);
+static bool grow_block(block_t *block, size_t asize);
+static block_t *alloc_aligned_block(size_t asize, size_t align);
+
+static bool is_slab_size(size_t size);
+static void *slab_malloc(size_t size);
+static void slab_free(slab_page_t *page, void *bp);
+static void slab_release(slab_page_t *page, int c);
+static slab_page_t *slab_new_page(int c);
+static slab_page_t *slab_page_of(void *bp);
+static int slab_map_index(void *page, size_t *bit);
+static bool slab_map_test(void *page);
+static bool slab_map_set(void *page);
+static void slab_map_clear(void *page);
+static void slab_link(slab_page_t *page, int c);
+static void slab_unlink(slab_page_t *page, int c);
 
 static void remove_block_link(block_t *block);
 static void reassign_blocks_link(block_t *free, block_t *alloc);
@@ -217,6 +775,11 @@ static void insert_free_block(block_t *block);
 
 static size_t max(size_t x, size_t y);
 static size_t round_up(size_t size, size_t n);
+static void sort_pointers(void **ptrs, size_t n);
+static void sort_range(void **ptrs, size_t n, size_t depth);
+static void heap_sort(void **ptrs, size_t n);
+static void sift_down(void **ptrs, size_t i, size_t n);
+static void swap_pointers(void **ptrs, size_t i, size_t j);
 static word_t pack(size_t size, bool alloc, bool prev_alloc, bool prev_small);
 
 static size_t extract_size(word_t header);
@@ -243,705 +806,3659 @@ static block_t *find_next(block_t *block);
 static word_t *find_prev_footer(block_t *block);
 static block_t *find_prev(block_t *block);
 
+static bool small_linkable(block_t *block);
+static uint32_t small_to_offset(block_t *block);
+static block_t *small_from_offset(uint32_t offset);
+
 static void print_free_list();
 static void print_heap();
 static void print_small_list();
-bool exists_in_heap(block_t* find);
+static bool is_alloc_block(block_t *block);
+static bool is_sized_block(void *bp, size_t size);
 static void write_next_header();
 
 /*
- * mm_init: Initialize the heap with boundary prologue and epilogue.
- *          Also initialize the free lists.
+ * mm_set_fit_policy: Select how find_fit picks a block among the fitting
+ *                    blocks of a size class. MM_FIT_FIRST takes the first
+ *                    one, MM_FIT_BEST_CLASS the smallest in the class, and
+ *                    MM_FIT_BEST_OF_N the smallest of the first few. Both
+ *                    best policies stop early on an exact fit. The policy
+ *                    is kept across mm_init. Returns false if unknown.
+ * 
+ * policy: one of MM_FIT_*
  */
-bool mm_init(void)
+bool mm_set_fit_policy(int policy)
 {
-    // Create the initial empty heap
-    word_t *start = (word_t *) (mem_sbrk(2 * wsize));
-
-    if (start == (void *)-1)
+    if (policy != MM_FIT_FIRST && policy != MM_FIT_BEST_CLASS 
+                            && policy != MM_FIT_BEST_OF_N)
     {
         return false;
     }
 
-    // Initialize prologue and epilogue which mark the heap boundary
-    start[0] = pack(0, true,false,false);  // Heap prologue (block footer)
-    start[1] = pack(0, true,true, false);  // Heap epilogue (block header)
+    fit_policy = policy;
+    return true;
+}
 
-    // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *) &(start[1]);
+/*
+ * mm_set_trim_threshold: Set the size the free block at the end of the 
+ *                        heap must exceed for free to shrink the heap, 
+ *                        down to half of threshold. 0 turns trimming off.
+ *                        The threshold is kept across mm_init.
+ * 
+ * threshold: trailing free block size in bytes
+ */
+void mm_set_trim_threshold(size_t threshold)
+{
+    trim_threshold = threshold;
+}
 
-    // Initialize free list
+/*
+ * mm_set_mmap_threshold: Set the request size from which malloc serves 
+ *                        requests from a mapping of their own rather than
+ *                        the heap. 0 keeps all blocks in the heap. The 
+ *                        threshold is kept across mm_init.
+ * 
+ * threshold: request size in bytes
+ */
+void mm_set_mmap_threshold(size_t threshold)
+{
+    mmap_threshold = threshold;
+}
+
+/*
+ * mm_get_stats: Fill stats with a snapshot of the heap, summed over the 
+ *               arenas under the lock of each. The free block counters 
+ *               are kept as blocks enter and leave the free lists, so the
+ *               snapshot only reads them and takes time linear in the 
+ *               number of size classes. Blocks held in quick lists or thread 
+ *               caches are allocated in the heap and not counted as free.
+ * 
+ * stats: snapshot to be filled
+ */
+void mm_get_stats(struct mm_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+#if THREAD_SAFE
+    arena_t *current = arena;
+
+    pthread_mutex_lock(&arena_lock);
     int i;
-    for (i = 0; i < FREE_LIST_SIZE; i++)
+    for (i = 0; i < arena_count; i++)
     {
-        free_list[i] = NULL;
+        arena = arenas[i];
+        mm_lock();
+        add_arena_stats(stats);
+        mm_unlock();
     }
+    pthread_mutex_unlock(&arena_lock);
 
-    // Initialize small free list
-    small_blocks_list = NULL;
-
-    // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL)
+    arena = current;
+#else
+    if (arena != NULL)
     {
-        return false;
+        add_arena_stats(stats);
     }
-
-    return true;
+#endif
 }
 
 /*
- * malloc: Allocate a block of given size in heap. If current heap does 
- *         not contain enough space, extend heap. Return a pointer to 
- *         payload of allocated block.
+ * mm_get_instrument: Fill counters with the hot path counters of a build 
+ *                    with MM_INSTRUMENT, summed over the arenas under the
+ *                    lock of each. Return false, with counters cleared, 
+ *                    in a build without them.
  * 
- * size: New block's size
+ * counters: counters to be filled
  */
-void *malloc(size_t size)
+bool mm_get_instrument(struct mm_instrument *counters)
 {
-    dbg_requires(mm_checkheap(__LINE__));
+    memset(counters, 0, sizeof(*counters));
 
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
-    block_t *block;
-    void *bp = NULL;
+#if MM_INSTRUMENT && THREAD_SAFE
+    arena_t *current = arena;
 
-    if (heap_start == NULL) // Initialize heap if it isn't initialized
+    pthread_mutex_lock(&arena_lock);
+    int i;
+    for (i = 0; i < arena_count; i++)
     {
-        mm_init();
+        arena = arenas[i];
+        mm_lock();
+        add_arena_counters(counters);
+        mm_unlock();
     }
+    pthread_mutex_unlock(&arena_lock);
 
-    if (size == 0) // Ignore spurious request
+    arena = current;
+#elif MM_INSTRUMENT
+    if (arena != NULL)
     {
-        dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
+        add_arena_counters(counters);
     }
+#endif
 
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + wsize, dsize);
-
-    // Search the free list for a fit
-    block = find_fit(asize);
+    return MM_INSTRUMENT;
+}
 
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL)
-    {   
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        if (block == NULL) // extend_heap returns an error
-        {
-            return bp;
-        }
+/*
+ * mm_init: Initialize the heap with its first arena. Other arenas of the
+ *          thread-safe build are created when threads are assigned to 
+ *          them.
+ */
+bool mm_init(void)
+{
+#if THREAD_SAFE
+    heap_epoch++;
+#endif
 
+    // The first arena lives in the main heap
+    if (!arena_init(0))
+    {
+        return false;
     }
 
-    // The block should be marked as free
-    dbg_assert(!get_alloc(block));
-
-    // Mark block as allocated
-    size_t block_size = get_size(block);
-    write_header(block, block_size, true, get_prev_alloc(block), get_prev_small(block));
-
-    // Try to split the block if too large
-    split_block(block, asize);
+#if THREAD_SAFE
+    arenas[0] = arena;
+    arena_count = 1;
+    arena_next = 0;
+#endif
 
-    bp = header_to_payload(block);
-    dbg_ensures(mm_checkheap(__LINE__));
-    return bp;
+    return true;
 }
 
 /*
- * free: Free the block pointed to by the given pointer. If null pointer
- *       is given or the block pointed to is free, just return. 
+ * arena_init: Create an arena at the end of a heap region, with its state
+ *             in front of the prologue and epilogue, and initialize its 
+ *             free lists. The new arena becomes the current arena.
  * 
- * bp: pointer to the block to be freed
+ * region: memlib heap region of the arena
  */
-void free(void *bp)
+static bool arena_init(int region)
 {
-    dbg_requires(mm_checkheap(__LINE__));
+    char *lo = (char *) (mem_region_sbrk(region, arena_size + dsize));
 
-    if (bp == NULL)
+    if (lo == (void *)-1)
     {
-        return;
+        return false;
     }
 
-    block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
+    arena = (arena_t *) lo;
+    arena->region = region;
+#if THREAD_SAFE
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->remote_free = NULL;
+#endif
 
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
-    if (!get_alloc(block))
+    // The prologue and epilogue end the 16 bytes after the state, so that
+    // payloads, which follow a header, are 16-byte aligned
+    word_t *start = (word_t *) (lo + arena_size + dsize - 2 * wsize);
+
+    // Initialize prologue and epilogue which mark the heap boundary
+    start[0] = pack(0, true,false,false);  // Heap prologue (block footer)
+    start[1] = pack(0, true,true, false);  // Heap epilogue (block header)
+
+    // Heap starts with first "block header", currently the epilogue
+    arena->heap_start = (block_t *) &(start[1]);
+
+    // Initialize free list
+    int i;
+    for (i = 0; i < FREE_LIST_SIZE; i++)
     {
-        return;
+        arena->free_list[i] = NULL;
     }
 
-    // Mark the block as free
-    write_header(block, size, false, get_prev_alloc(block), get_prev_small(block));
-
-    if (size > dsize)
+#if TLSF_INDEX
+    arena->fl_map = 0;
+    for (i = 0; i < FL_COUNT; i++)
     {
-        write_footer(block, size, false, get_prev_alloc(block), get_prev_small(block));
+        arena->sl_map[i] = 0;
     }
+#else
+    arena->free_list_map = 0;
+#endif
 
-    // Try to coalesce the block with its neighbors
-    block = coalesce_block(block);
-    dbg_ensures(mm_checkheap(__LINE__));
-}
+    // Initialize small free list
+    arena->small_blocks_list = NULL;
 
-/*
- * print_free_list: print eaach block in all the free lists
- */
-static void print_free_list(void)
-{
-    block_t *block;
-    int count = 1;
-    int i;
-    for (i = 0; i < FREE_LIST_SIZE; i++)
+    // Start growing by chunksize
+    arena->grow_step = chunksize;
+    arena->grow_ops = 0;
+
+    // Initialize slab page lists
+    for (i = 0; i < SLAB_CLASSES; i++)
     {
-        block = free_list[i];
-        count = 1;
-        dbg_printf("Class size 2 ^ %d\n", i + 4);
-        while (block != NULL)
-        {
-            
-            dbg_printf("free block #%d %p prev %p/ next %p size %zu\n",
-            count, (void *)block, (void *)block->data.link.prev, (void *)block->data.link.next, get_size(block));
-            count ++;
-            block = block->data.link.next;
-        }
-        
+        arena->slab_lists[i] = NULL;
+    }
+    arena->slab_pages = 0;
+    memset(arena->slab_demand, 0, sizeof(arena->slab_demand));
+    for (i = 0; i < SLAB_MAP_CHUNKS; i++)
+    {
+        arena->slab_map[i] = NULL;
+    }
+
+    // Initialize free block counters
+    for (i = 0; i < MM_STATS_CLASSES; i++)
+    {
+        arena->class_blocks[i] = 0;
+        arena->class_bytes[i] = 0;
+        arena->class_max[i] = 0;
+    }
+    arena->tree_max = NULL;
+
+#if MM_INSTRUMENT
+    memset(&arena->counters, 0, sizeof(arena->counters));
+    arena->probes = 0;
+#endif
+
+#if QUICK_LISTS
+    // Initialize quick lists
+    for (i = 0; i < QUICK_BINS; i++)
+    {
+        arena->quick_lists[i] = NULL;
+        arena->quick_counts[i] = 0;
+    }
+#endif
+
+    // Extend the empty heap with a free block of chunksize bytes
+    if (extend_heap(chunksize) == NULL)
+    {
+        return false;
     }
+
+    return true;
 }
 
 /*
- * print_small_list: print eaach block in the small_block_list
+ * malloc: Allocate a block of given size. The thread-safe build first 
+ *         tries the cache of the calling thread, and only takes the lock
+ *         of the thread's arena on a miss, freeing the blocks that other
+ *         threads returned to the arena. Return a pointer to payload of 
+ *         allocated block.
+ * 
+ * size: New block's size
  */
-static void print_small_list(void)
+void *malloc(size_t size)
 {
-    block_t *block;
-    int count = 1;
+    void *bp;
 
-    for (block = small_blocks_list; block != NULL; block = block->data.link.next)
+#if THREAD_SAFE
+    bp = tcache_get(size);
+    if (bp != NULL)
     {
-        dbg_printf("small free block #%d %p next %p\n",
-            count, (void *)block, (void *)block->data.link.next);
-        count ++;
+        return bp;
     }
+    arena = arena_home();
+#endif
+
+    mm_lock();
+#if THREAD_SAFE
+    remote_drain();
+#endif
+    bp = heap_malloc(size);
+    mm_unlock();
+    return bp;
 }
 
 /*
- * print_heap: print eaach block in the heap
+ * free: Free the block pointed to by the given pointer. The thread-safe 
+ *       build unmaps mapped blocks right away, as they belong to no 
+ *       arena. It keeps other blocks in the cache of the calling thread 
+ *       if their bin has room. Otherwise it takes the lock of the arena 
+ *       holding the block if that is the thread's own arena, or pushes 
+ *       the block on the remote free stack of the arena without locking.
+ * 
+ * bp: pointer to the block to be freed
  */
-static void print_heap(void)
+void free(void *bp)
 {
-    block_t *block;
-    int count = 1;
-    for (block = heap_start; get_size(block) > 0;
-                            block = find_next(block))
+    if (bp == NULL)
     {
-        dbg_printf(" block #%d %p alloc %d p_alloc %d size %zu",
-        count, (void *)block, get_alloc(block), get_prev_alloc(block),get_size(block));
-        if (!get_alloc(block))
-        {
-            dbg_printf(" prev %p/ next %p\n",(void *)block->data.link.prev, (void *)block->data.link.next);
+        return;
+    }
 
-        } 
-        else {
-            dbg_printf("\n");
-        }
+#if THREAD_SAFE
+    block_t *mapped = map_block_of(bp);
+    if (mapped != NULL)
+    {
+        map_free(mapped);
+        return;
+    }
 
-        dbg_printf("payload: %p ", header_to_payload(block));
-        if (get_size(block) > dsize)
-        {
-            dbg_printf("footer: %p", (void*) header_to_footer(block));
-        }
-        dbg_printf("\n");
-        count++;
+    arena = arena_of(bp);
+    if (arena == NULL || tcache_put(bp, tcache_block_class(bp)))
+    {
+        return;
     }
-    
+
+    // Blocks of another arena are left to its next malloc
+    if (arena != tcache.arena)
+    {
+        remote_push(bp);
+        return;
+    }
+#endif
+
+    mm_lock();
+    heap_free(bp);
+    mm_unlock();
 }
 
 /*
- * realloc: Reassign the memory pointed by the given pointer. Return  
- *          a new pointer to the new allocated block with a given size.
- *          If the given size is zero or the given pointer is NULL, just
- *          return NULL.
+ * realloc: Reassign the memory pointed by the given pointer under the 
+ *          lock of the arena that holds it, or of the thread's own arena
+ *          for mapped blocks, see heap_realloc.
  * 
  * ptr: pointer to original allocated memmory
  * size: desired size of the new allocated block
  */
 void *realloc(void *ptr, size_t size)
 {
-    size_t copysize;
-    void *newptr;
-
-    // If size == 0, then free block and return NULL
-    if (size == 0)
+#if THREAD_SAFE
+    arena = (ptr == NULL || map_block_of(ptr) != NULL) 
+                ? arena_home() : arena_of(ptr);
+    if (arena == NULL)
     {
-        free(ptr);
         return NULL;
     }
+#endif
 
-    // If ptr is NULL, then equivalent to malloc
+    mm_lock();
+    void *newptr = heap_realloc(ptr, 0, size);
+    mm_unlock();
+    return newptr;
+}
+
+/*
+ * mm_free_sized: Free a block, given the size it was last requested with,
+ *                as free does. Knowing the size spares the probe for a 
+ *                slab page and the header read that picks the cache bin
+ *                or quick list of the block, see heap_free_sized. Debug 
+ *                builds check the size against the block.
+ * 
+ * ptr: pointer to the block to be freed
+ * size: size the block was last requested with
+ */
+void mm_free_sized(void *ptr, size_t size)
+{
     if (ptr == NULL)
     {
-        return malloc(size);
+        return;
     }
 
-    block_t *block = payload_to_header(ptr);
-    if (!exists_in_heap(block))
+#if THREAD_SAFE
+    block_t *mapped = map_block_of(ptr);
+    if (mapped != NULL)
     {
-        return NULL;
+        map_free(mapped);
+        return;
     }
-    
-    // Otherwise, proceed with reallocation
-    newptr = malloc(size);
 
-    // If malloc fails, the original block is left untouched
-    if (newptr == NULL)
+    arena = arena_of(ptr);
+    if (arena == NULL)
     {
-        return NULL;
+        return;
     }
+    dbg_assert(is_sized_block(ptr, size));
 
-    // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
-    if (size < copysize)
+    // Only sizes a slab slot could hold need the block to pick the bin
+    int i = (SLAB_ALLOC && size <= slab_max_size) 
+                ? tcache_block_class(ptr) : tcache_class(size);
+    if (tcache_put(ptr, i))
     {
-        copysize = size;
+        return;
     }
 
-    memcpy(newptr, ptr, copysize);
-
-    // Free the old block
-    free(ptr);
+    if (arena != tcache.arena)
+    {
+        remote_push(ptr);
+        return;
+    }
+#endif
 
-    return newptr;
+    mm_lock();
+    heap_free_sized(ptr, size);
+    mm_unlock();
 }
 
 /*
- * exists_in_heap: check if a block exist in current heap
+ * mm_realloc_sized: Reassign a block, given the size it was last requested
+ *                   with, as realloc does. Sizes above slab_max_size skip
+ *                   the probe for a slab page, and a moved block copies 
+ *                   only the old size instead of its whole payload. Debug
+ *                   builds check the size against the block.
  * 
- * find: target block to find 
+ * ptr: pointer to original allocated memory
+ * old_size: size the block was last requested with
+ * size: desired size of the new allocated block
  */
-bool exists_in_heap(block_t* find)
+void *mm_realloc_sized(void *ptr, size_t old_size, size_t size)
 {
-    dbg_printf("exists_in_heap\n");
-    block_t* block;
-    for (block = heap_start; get_size(block) > 0;
-                            block = find_next(block))
+#if THREAD_SAFE
+    arena = (ptr == NULL || map_block_of(ptr) != NULL) 
+                ? arena_home() : arena_of(ptr);
+    if (arena == NULL)
     {
-        if (find == block && get_alloc(block))
-        {
-            dbg_printf("true\n");
-            return true;
-        }
-        
+        return NULL;
     }
-    dbg_printf("false\n");
-    return false;
+#endif
+
+    mm_lock();
+    dbg_assert(ptr == NULL || is_sized_block(ptr, old_size));
+    void *newptr = heap_realloc(ptr, ptr == NULL ? 0 : old_size, size);
+    mm_unlock();
+    return newptr;
 }
+
 /*
- * calloc: Allocate an array of a given number of element of a given
- *         size. Initialize the payload to 0 and return pointer to 
- *         payload.
+ * memalign: Allocate a block whose payload is aligned to the given power
+ *           of two. Alignments up to 16 bytes are those of malloc, larger
+ *           ones are allocated under the lock of the thread's arena, see
+ *           heap_memalign. Return null if the alignment is not a power of
+ *           two.
  * 
- * elements: the number of element in the array
- * size: the size of each element 
+ * alignment: required payload alignment
+ * size: requested size
  */
-void *calloc(size_t elements, size_t size)
+void *memalign(size_t alignment, size_t size)
 {
-    void *bp;
-    size_t asize = elements * size;
-
-    if (asize/elements != size)
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
     {
-        // Multiplication overflowed
         return NULL;
     }
 
-    bp = malloc(asize);
-    if (bp == NULL)
+    if (alignment <= dsize)
     {
-        return NULL;
+        return malloc(size);
     }
 
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+#if THREAD_SAFE
+    arena = arena_home();
+#endif
 
+    mm_lock();
+#if THREAD_SAFE
+    remote_drain();
+#endif
+    void *bp = heap_memalign(alignment, size);
+    mm_unlock();
     return bp;
 }
 
-/******** The remaining content below are helper and debug routines ********/
-
 /*
- * extend_heap: Create new free block given a size at the end of epilogue.
- *              Update epilogue position and return the newly added
- *              free block.
+ * posix_memalign: Allocate a block aligned like memalign and store it in
+ *                 memptr. Return EINVAL if the alignment is not a power 
+ *                 of two multiple of the pointer size, or ENOMEM, leaving
+ *                 memptr untouched. A size of 0 stores null.
  * 
- * size: Size for the new free block
+ * memptr: location receiving the payload pointer
+ * alignment: required payload alignment
+ * size: requested size
  */
-static block_t *extend_heap(size_t size)
+int posix_memalign(void **memptr, size_t alignment, size_t size)
 {
-    void *bp;
-
-    // Allocate an even number of words to maintain alignment
-    size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1)
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
     {
-        return NULL;
+        return EINVAL;
     }
 
-    // Get new free block position from payload
-    block_t *block = payload_to_header(bp);
-    
-    // Get previous block information from old epilogue, 
-    // which has become the new free block's header
-    bool prev_alloc = extract_prev_alloc(block->header);
-    bool prev_small = extract_prev_small(block->header);
-
-    write_header(block, size, false, prev_alloc, prev_small);
-    write_footer(block, size, false, prev_alloc, prev_small);
-
-    // Create new epilogue header
-    block_t *block_next = find_next(block);
-    write_header(block_next, 0, true, false, (get_size(block) <= dsize));
-
-    // Coalesce in case the previous block was free
-    block = coalesce_block(block);
+    void *bp = memalign(alignment, size);
+    if (bp == NULL && size != 0)
+    {
+        return ENOMEM;
+    }
 
-    return block;
+    *memptr = bp;
+    return 0;
 }
 
-
 /*
- * coalesce_block: Combine a free block with its adjacent neighbors. 
- *                 Four possible cases of block arrangements include: 
- *                 (prev_alloc + next_alloc), (prev_alloc + !next_alloc),
- *                 (!prev_alloc + next_alloc), (!prev_alloc + !next_alloc).
- *                 Each case is handled differently. Return a free block  
- *                 resulting from the coalescence.
+ * aligned_alloc: Allocate a block aligned like memalign. Return null if 
+ *                the alignment is not a power of two.
  * 
- * block: free block to be checked for coalescence
+ * alignment: required payload alignment
+ * size: requested size
  */
-static block_t *coalesce_block(block_t *block)
+void *aligned_alloc(size_t alignment, size_t size)
 {
-    dbg_requires(!get_alloc(block));
-
-    size_t size = get_size(block);
+    return memalign(alignment, size);
+}
 
-    block_t *block_next = find_next(block);
+/*
+ * mm_usable_size: Return the number of bytes the block can hold, at least
+ *                 the size it was requested with: the payload of a heap 
+ *                 or mapped block, or the slot size of a slab object. 
+ *                 Return 0 for a null pointer. Slab objects are told 
+ *                 apart by the slab page bitmap (see slab_page_of) and 
+ *                 their slot size is fixed, so they need no lock. The 
+ *                 header of a heap block is read under the lock of its 
+ *                 arena, as mm_try_expand may be rewriting it.
+ * 
+ * ptr: pointer to the block payload
+ */
+size_t mm_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return 0;
+    }
 
-    bool prev_alloc = get_prev_alloc(block);
-    bool next_alloc = get_alloc(block_next);
+    block_t *mapped = map_block_of(ptr);
+    if (mapped != NULL)
+    {
+        return map_length(mapped) - dsize;
+    }
 
-    if (prev_alloc && next_alloc)              // Case 1
-    {   
-        insert_free_block(block);
-        write_next_header(block);
+#if THREAD_SAFE
+    arena = arena_of(ptr);
+    if (arena == NULL)
+    {
+        return 0;
     }
+#endif
 
-    else if (prev_alloc && !next_alloc)        // Case 2
+    slab_page_t *page;
+    if (SLAB_ALLOC && (page = slab_page_of(ptr)) != NULL)
     {
-        size += get_size(block_next);
-        remove_block_link(block_next);
+        return page->obj_size;
+    }
 
-        write_header(block, size, false, get_prev_alloc(block), get_prev_small(block));
-        write_footer(block, size, false, get_prev_alloc(block), get_prev_small(block));
+    mm_lock();
+    size_t usable = get_payload_size(payload_to_header(ptr));
+    mm_unlock();
+    return usable;
+}
 
-        insert_free_block(block);
-        write_next_header(block);  
+/*
+ * mm_try_expand: Grow a block to the given size without moving it, 
+ *                under the lock of the arena holding it, see 
+ *                heap_try_expand. A mapped block only fits sizes within 
+ *                its mapping. Return true if the block holds size bytes,
+ *                or false, with the block untouched, if it can't hold 
+ *                them in place.
+ * 
+ * ptr: pointer to the block payload
+ * size: desired size of the block
+ */
+bool mm_try_expand(void *ptr, size_t size)
+{
+    if (ptr == NULL || size == 0)
+    {
+        return false;
     }
 
-    else if (!prev_alloc && next_alloc)        // Case 3
+    block_t *mapped = map_block_of(ptr);
+    if (mapped != NULL)
     {
-        block_t *block_prev = find_prev(block);
-         
-        size += get_size(block_prev);
-        remove_block_link(block_prev);
-        write_header(block_prev, size, false, get_prev_alloc(block_prev),get_prev_small(block_prev));
-        write_footer(block_prev, size, false, get_prev_alloc(block_prev),get_prev_small(block_prev));
-        
-        insert_free_block(block_prev);
-        write_next_header(block_prev);
-        block = block_prev;
+        return size <= map_length(mapped) - dsize;
     }
 
-    else                                        // Case 4
+#if THREAD_SAFE
+    arena = arena_of(ptr);
+    if (arena == NULL)
     {
-        block_t *block_prev = find_prev(block);
-
-        size += get_size(block_next) + get_size(block_prev);
-
-        remove_block_link(block_prev);
-        remove_block_link(block_next);
+        return false;
+    }
+#endif
 
-        write_header(block_prev, size, false, get_prev_alloc(block_prev), get_prev_small(block_prev));
-        write_footer(block_prev, size, false, get_prev_alloc(block_prev), get_prev_small(block_prev));
+    mm_lock();
+    bool expanded = heap_try_expand(ptr, size);
+    mm_unlock();
+    return expanded;
+}
 
-        insert_free_block(block_prev);
+/*
+ * heap_malloc: Allocate a block of given size in heap. If current heap does 
+ *              not contain enough space, extend heap. Requests of at least
+ *              the mmap threshold are mapped, and only fall back to the 
+ *              heap if mapping fails. Return a pointer to payload of 
+ *              allocated block.
+ * 
+ * size: New block's size
+ */
+static void *heap_malloc(size_t size)
+{
+    dbg_requires(mm_checkheap(__LINE__));
+
+    size_t asize;      // Adjusted block size
+    size_t extendsize; // Amount to extend heap if no fit is found
+    block_t *block;
+    void *bp = NULL;
+
+    if (arena == NULL) // Initialize heap if it isn't initialized
+    {
+        mm_init();
+    }
+
+    arena->zero_start = NULL;
+
+    if (size == 0) // Ignore spurious request
+    {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    arena->grow_ops++;
+
+    // Small requests are served by slab pages, or by the heap when no
+    // page can be added
+    if (is_slab_size(size) && (bp = slab_malloc(size)) != NULL)
+    {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    // Huge requests get a mapping of their own
+    if (mmap_threshold > 0 && size >= mmap_threshold)
+    {
+        bp = map_malloc(size);
+        if (bp != NULL)
+        {
+            arena->zero_start = mem_map_clean() ? (char *) bp : NULL;
+            return bp;
+        }
+    }
+
+    // Adjust block size to include overhead and to meet alignment requirements
+    asize = round_up(size + wsize, dsize);
+
+    // Reuse a recently freed block of the exact size
+    block = quick_get(asize);
+    if (block != NULL)
+    {
+        bp = header_to_payload(block);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    // Search the free list for a fit, coalescing the quick lists on a miss
+    block = find_fit(asize);
+    if (block == NULL && quick_flush())
+    {
+        block = find_fit(asize);
+    }
+
+    // If no fit is found, request more memory, and then and place the block
+    if (block == NULL)
+    {   
+        // A free block at the end of the heap coalesces with the new 
+        // memory, so only the rest is needed
+        size_t tail = tail_free_size();
+        extendsize = grow_size(tail < asize ? asize - tail : 0);
+        char *brk = (char *) mem_region_hi(arena->region) + 1;
+        char *clean = (char *) mem_region_clean(arena->region);
+        block = extend_heap(extendsize);
+        if (block == NULL) // extend_heap returns an error
+        {
+            return bp;
+        }
+        arena->zero_start = clean > brk ? clean : brk;
+
+    }
+
+    // The block should be marked as free
+    dbg_assert(!get_alloc(block));
+
+    // Take the block out of its free list and mark it as allocated
+    remove_block_link(block);
+    size_t block_size = get_size(block);
+    write_header(block, block_size, true, get_prev_alloc(block), get_prev_small(block));
+
+    // Try to split the block if too large
+    split_block(block, asize);
+
+    bp = header_to_payload(block);
+    dbg_ensures(mm_checkheap(__LINE__));
+    return bp;
+}
+
+/*
+ * heap_memalign: Allocate a block of given size in heap whose payload is
+ *                aligned to align bytes, which must be a power of two 
+ *                above 16. The block is cut from a fit with room for the
+ *                alignment by alloc_aligned_block, which returns the slack
+ *                before the payload to the free lists. Return a pointer to
+ *                the payload, or null.
+ * 
+ * align: required payload alignment
+ * size: requested size
+ */
+static void *heap_memalign(size_t align, size_t size)
+{
+    dbg_requires(mm_checkheap(__LINE__));
+
+    if (arena == NULL) // Initialize heap if it isn't initialized
+    {
+        mm_init();
+    }
+
+    arena->zero_start = NULL;
+
+    // Ignore spurious requests and sizes no heap could hold
+    if (size == 0 || size > SIZE_MAX / 4 || align > SIZE_MAX / 4)
+    {
+        return NULL;
+    }
+
+    arena->grow_ops++;
+
+    block_t *block = alloc_aligned_block(round_up(size + wsize, dsize), align);
+    if (block == NULL)
+    {
+        return NULL;
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return header_to_payload(block);
+}
+
+/*
+ * heap_free: Free the block pointed to by the given pointer. If null 
+ *            pointer is given or the block pointed to is free, just return.
+ * 
+ * bp: pointer to the block to be freed
+ */
+static void heap_free(void *bp)
+{
+    dbg_requires(mm_checkheap(__LINE__));
+
+    if (bp == NULL)
+    {
+        return;
+    }
+
+    // Mapped blocks are unmapped
+    block_t *mapped = map_block_of(bp);
+    if (mapped != NULL)
+    {
+        map_free(mapped);
+        return;
+    }
+
+    // Slab objects go back to their page
+    slab_page_t *page;
+    if (SLAB_ALLOC && (page = slab_page_of(bp)) != NULL)
+    {
+        slab_free(page, bp);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+
+    block_t *block = payload_to_header(bp);
+
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
+    if (!get_alloc(block))
+    {
+        return;
+    }
+
+    // Small blocks wait in their quick list
+    if (!quick_put(block, get_size(block)))
+    {
+        release_block(block);
+    }
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/*
+ * heap_free_sized: Free a block whose requested size the caller knows. 
+ *                  Sizes above slab_max_size can't be slab objects, as
+ *                  realloc moves slots that outgrow their slot size, so 
+ *                  no slab page is probed for them. A heap block has the
+ *                  adjusted size of its last request, which picks its 
+ *                  quick list without decoding the header. Smaller sizes
+ *                  may belong to slab objects or to heap blocks, and are
+ *                  freed by heap_free.
+ * 
+ * bp: pointer to the block to be freed
+ * size: size the block was last requested with
+ */
+static void heap_free_sized(void *bp, size_t size)
+{
+    if (bp == NULL || (SLAB_ALLOC && size <= slab_max_size))
+    {
+        heap_free(bp);
+        return;
+    }
+
+    dbg_requires(mm_checkheap(__LINE__));
+    dbg_assert(is_sized_block(bp, size));
+
+    // Mapped blocks are unmapped
+    block_t *mapped = map_block_of(bp);
+    if (mapped != NULL)
+    {
+        map_free(mapped);
+        return;
+    }
+
+    block_t *block = payload_to_header(bp);
+    if (!quick_put(block, round_up(size + wsize, dsize)))
+    {
+        release_block(block);
+    }
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/*
+ * release_block: Mark an allocated block as free, coalesce it with its
+ *                neighbors and insert it into the free lists. A large 
+ *                free block left at the end of the heap is trimmed.
+ * 
+ * block: allocated block to be released
+ */
+static void release_block(block_t *block)
+{
+    size_t size = get_size(block);
+
+    // Mark the block as free
+    write_header(block, size, false, get_prev_alloc(block), get_prev_small(block));
+
+    if (size > dsize)
+    {
+        write_footer(block, size, false, get_prev_alloc(block), get_prev_small(block));
+    }
+
+    // Try to coalesce the block with its neighbors
+    block = coalesce_block(block);
+
+    // Give a large free block at the end of the heap back to memlib
+    if (trim_threshold > 0 && get_size(block) > trim_threshold 
+            && get_size(find_next(block)) == 0)
+    {
+        trim_heap(block);
+    }
+}
+
+/*
+ * print_free_list: print eaach block in all the free lists
+ */
+static void print_free_list(void)
+{
+    block_t *block;
+    int count = 1;
+    int i;
+    for (i = 0; i < FREE_LIST_SIZE; i++)
+    {
+        block = arena->free_list[i];
+        count = 1;
+        if (block == NULL)
+        {
+            continue;
+        }
+        dbg_printf("Size class %d\n", i);
+        if (i == tree_class)
+        {
+            for (block = tree_min(block); block != NULL; 
+                                            block = tree_next(block))
+            {
+                dbg_printf("free block #%d %p left %p/ right %p size %zu\n",
+                count, (void *)block, (void *)block->data.node.left, 
+                (void *)block->data.node.right, get_size(block));
+                count ++;
+            }
+            continue;
+        }
+        while (block != NULL)
+        {
+            
+            dbg_printf("free block #%d %p prev %p/ next %p size %zu\n",
+            count, (void *)block, (void *)block->data.link.prev, (void *)block->data.link.next, get_size(block));
+            count ++;
+            block = block->data.link.next;
+        }
+        
+    }
+}
+
+/*
+ * print_small_list: print eaach block in the small_block_list
+ */
+static void print_small_list(void)
+{
+    block_t *block;
+    int count = 1;
+
+    for (block = arena->small_blocks_list; block != NULL; 
+                            block = small_from_offset(block->data.small.next))
+    {
+        dbg_printf("small free block #%d %p prev %p/ next %p\n",
+            count, (void *)block, 
+            (void *)small_from_offset(block->data.small.prev), 
+            (void *)small_from_offset(block->data.small.next));
+        count ++;
+    }
+}
+
+/*
+ * print_heap: print eaach block in the heap
+ */
+static void print_heap(void)
+{
+    block_t *block;
+    int count = 1;
+    for (block = arena->heap_start; get_size(block) > 0;
+                            block = find_next(block))
+    {
+        dbg_printf(" block #%d %p alloc %d p_alloc %d size %zu",
+        count, (void *)block, get_alloc(block), get_prev_alloc(block),get_size(block));
+        if (!get_alloc(block))
+        {
+            dbg_printf(" prev %p/ next %p\n",(void *)block->data.link.prev, (void *)block->data.link.next);
+
+        } 
+        else {
+            dbg_printf("\n");
+        }
+
+        dbg_printf("payload: %p ", header_to_payload(block));
+        if (get_size(block) > dsize)
+        {
+            dbg_printf("footer: %p", (void*) header_to_footer(block));
+        }
+        dbg_printf("\n");
+        count++;
+    }
+    
+}
+
+/*
+ * heap_realloc: Reassign the memory pointed by the given pointer. Return  
+ *               a new pointer to the new allocated block with a given 
+ *               size. If the given size is zero or the given pointer is 
+ *               NULL, just return NULL. The block is resized in place when
+ *               possible: a shrink returns the unused tail to the free 
+ *               lists, and a growth absorbs the next free block or extends
+ *               the heap when the block is last. Otherwise the payload is
+ *               moved.
+ * 
+ * ptr: pointer to original allocated memmory
+ * old_size: size the block was last requested with, or 0 if unknown
+ * size: desired size of the new allocated block
+ */
+static void *heap_realloc(void *ptr, size_t old_size, size_t size)
+{
+    void *newptr;
+
+    // If size == 0, then free block and return NULL
+    if (size == 0)
+    {
+        if (old_size == 0)
+        {
+            heap_free(ptr);
+        } else
+        {
+            heap_free_sized(ptr, old_size);
+        }
+        return NULL;
+    }
+
+    // If ptr is NULL, then equivalent to malloc
+    if (ptr == NULL)
+    {
+        return heap_malloc(size);
+    }
+
+    // Mapped blocks stay put while they need the same number of pages. 
+    // Blocks that stay huge are remapped without copying, and blocks that 
+    // shrank below the threshold move back into the heap.
+    block_t *mapped = map_block_of(ptr);
+    if (mapped != NULL)
+    {
+        size_t len = map_length(mapped);
+        if (size <= len - dsize && size + dsize > len - MEM_MAP_ALIGN)
+        {
+            return ptr;
+        }
+
+        if (mmap_threshold > 0 && size >= mmap_threshold)
+        {
+            newptr = map_realloc(mapped, size);
+            if (newptr != NULL)
+            {
+                return newptr;
+            }
+        }
+
+        newptr = heap_malloc(size);
+        if (newptr == NULL)
+        {
+            return NULL;
+        }
+
+        memcpy(newptr, ptr, copy_size(len - dsize, old_size, size));
+        map_free(mapped);
+        return newptr;
+    }
+
+    // Slab objects keep their slot when shrinking, otherwise move. Larger
+    // old sizes can't be slab objects.
+    slab_page_t *page;
+    if (SLAB_ALLOC && old_size <= slab_max_size 
+            && (page = slab_page_of(ptr)) != NULL)
+    {
+        if (size <= page->obj_size)
+        {
+            return ptr;
+        }
+
+        newptr = heap_malloc(size);
+        if (newptr == NULL)
+        {
+            return NULL;
+        }
+
+        memcpy(newptr, ptr, copy_size(page->obj_size, old_size, size));
+        heap_free(ptr);
+        return newptr;
+    }
+
+    block_t *block = payload_to_header(ptr);
+    if (!is_alloc_block(block))
+    {
+        return NULL;
+    }
+
+    // Adjust block size to include overhead and to meet alignment requirements
+    size_t asize = round_up(size + wsize, dsize);
+
+    // Shrink in place, splitting the unused tail off as a free block
+    if (asize <= get_size(block))
+    {
+        split_block(block, asize);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return ptr;
+    }
+
+    // Grow in place into the next free block or the heap tail
+    if (grow_block(block, asize))
+    {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return ptr;
+    }
+    
+    // Otherwise, proceed with reallocation
+    newptr = heap_malloc(size);
+
+    // If malloc fails, the original block is left untouched
+    if (newptr == NULL)
+    {
+        return NULL;
+    }
+
+    // Copy the old data
+    memcpy(newptr, ptr, copy_size(get_payload_size(block), old_size, size));
+
+    // Free the old block, which is known to be a heap block
+    if (!quick_put(block, get_size(block)))
+    {
+        release_block(block);
+    }
+
+    return newptr;
+}
+
+/*
+ * heap_try_expand: Grow a slab object or heap block in place. A slab 
+ *                  object only fits sizes up to its slot size. A heap 
+ *                  block that is too small grows like it does in realloc.
+ *                  A block that already holds size bytes is left as it 
+ *                  is, shrinking is left to realloc. Return false if the
+ *                  block can't hold size bytes in place.
+ * 
+ * bp: pointer to the block payload
+ * size: desired size of the block
+ */
+static bool heap_try_expand(void *bp, size_t size)
+{
+    slab_page_t *page;
+    if (SLAB_ALLOC && (page = slab_page_of(bp)) != NULL)
+    {
+        return size <= page->obj_size;
+    }
+
+    block_t *block = payload_to_header(bp);
+    if (!is_alloc_block(block) || size > SIZE_MAX - dsize)
+    {
+        return false;
+    }
+
+    size_t asize = round_up(size + wsize, dsize);
+    if (asize <= get_size(block))
+    {
+        return true;
+    }
+
+    if (!grow_block(block, asize))
+    {
+        return false;
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return true;
+}
+
+/*
+ * copy_size: Return the number of bytes realloc moves from a block: its 
+ *            payload size, cut to the size it was last requested with if
+ *            known, and to the new size.
+ * 
+ * payload: payload size of the block
+ * old_size: size the block was last requested with, or 0 if unknown
+ * size: desired size of the new allocated block
+ */
+static size_t copy_size(size_t payload, size_t old_size, size_t size)
+{
+    size_t copysize = payload;
+    if (old_size != 0 && old_size < copysize)
+    {
+        copysize = old_size;
+    }
+    return (size < copysize) ? size : copysize;
+}
+
+/*
+ * is_alloc_block: check in constant time that a block pointer refers to an
+ *                 allocated block of the current heap. The block must lie
+ *                 within the heap bounds with an aligned payload, carry a
+ *                 sane allocated header, and its next block must agree
+ *                 through its prev alloc and prev small bits.
+ * 
+ * block: block to be validated
+ */
+static bool is_alloc_block(block_t *block)
+{
+    char *lo = (char *)arena->heap_start;
+    char *hi = (char *)mem_region_hi(arena->region);
+
+    // Header and payload must be inside the heap, payload must be aligned
+    if ((char *)block < lo || (char *)block + dsize > hi
+            || ((unsigned long)header_to_payload(block) & (dsize - 1)) != 0)
+    {
+        return false;
+    }
+
+    size_t size = get_size(block);
+    if (!get_alloc(block) || size < dsize)
+    {
+        return false;
+    }
+
+    // Next header must be inside the heap (at the latest the epilogue)
+    if (size > (size_t)(hi + 1 - (char *)block) - wsize)
+    {
+        return false;
+    }
+
+    // Next block must see this block as allocated with matching size
+    block_t *block_next = find_next(block);
+    return get_prev_alloc(block_next) 
+            && get_prev_small(block_next) == (size <= dsize);
+}
+
+/*
+ * is_sized_block: check that a payload pointer refers to a mapped block, 
+ *                 a slab object or an allocated heap block that could have
+ *                 been last requested with the given size. A heap block 
+ *                 has exactly the adjusted size of its request.
+ * 
+ * bp: pointer to the block payload
+ * size: size the block was last requested with
+ */
+static bool is_sized_block(void *bp, size_t size)
+{
+    if (size == 0)
+    {
+        return false;
+    }
+
+    block_t *mapped = map_block_of(bp);
+    if (mapped != NULL)
+    {
+        return size <= map_length(mapped) - dsize;
+    }
+
+    slab_page_t *page;
+    if (SLAB_ALLOC && (page = slab_page_of(bp)) != NULL)
+    {
+        return size <= page->obj_size;
+    }
+
+    block_t *block = payload_to_header(bp);
+    return is_alloc_block(block) 
+            && get_size(block) == round_up(size + wsize, dsize);
+}
+
+/*
+ * calloc: Allocate an array of a given number of element of a given
+ *         size. Initialize the payload to 0 and return pointer to 
+ *         payload. Allocates like malloc, and skips clearing the part 
+ *         of the payload that heap_malloc reports as still zero.
+ * 
+ * elements: the number of element in the array
+ * size: the size of each element 
+ */
+void *calloc(size_t elements, size_t size)
+{
+    void *bp;
+    size_t asize = elements * size;
+
+    if (elements != 0 && asize/elements != size)
+    {
+        // Multiplication overflowed
+        return NULL;
+    }
+
+#if THREAD_SAFE
+    bp = tcache_get(asize);
+    if (bp != NULL)
+    {
+        memset(bp, 0, asize);
+        return bp;
+    }
+    arena = arena_home();
+#endif
+
+    mm_lock();
+#if THREAD_SAFE
+    remote_drain();
+#endif
+    bp = heap_malloc(asize);
+    char *zero_start = bp != NULL ? arena->zero_start : NULL;
+    mm_unlock();
+
+    if (bp == NULL)
+    {
+        return NULL;
+    }
+
+    // Clear the dirty head of the payload, which holds at least the links
+    // of the free block it came from
+    size_t dirty = asize;
+    if (zero_start != NULL)
+    {
+        dirty = zero_start > (char *) bp ? (size_t) (zero_start - (char *) bp) : 0;
+        dirty = max(dirty, sizeof(union data_t));
+    }
+    if (dirty >= asize)
+    {
+        memset(bp, 0, asize);
+        return bp;
+    }
+    memset(bp, 0, dirty);
+
+    // The last word of the block may hold the footer of a free block
+    size_t tail = max(dirty, asize - wsize);
+    memset((char *) bp + tail, 0, asize - tail);
+
+    return bp;
+}
+
+/*
+ * mm_malloc_batch: Allocate up to n blocks of the same size under a single
+ *                  lock of the thread's arena, see heap_malloc_batch. 
+ *                  Return the number of blocks stored in ptrs, which is 
+ *                  less than n only if the heap can't grow.
+ * 
+ * size: size of each block
+ * ptrs: array receiving the payload pointers
+ * n: number of blocks
+ */
+size_t mm_malloc_batch(size_t size, void **ptrs, size_t n)
+{
+#if THREAD_SAFE
+    arena = arena_home();
+#endif
+
+    mm_lock();
+#if THREAD_SAFE
+    remote_drain();
+#endif
+    size_t count = heap_malloc_batch(size, ptrs, n);
+    mm_unlock();
+    return count;
+}
+
+/*
+ * mm_free_batch: Free n blocks at once under one lock, see heap_free_batch.
+ *                The thread-safe build unmaps mapped blocks right away and
+ *                pushes the blocks of other arenas on their remote free 
+ *                stacks, as free does, and leaves the blocks of the 
+ *                thread's own arena to heap_free_batch. Null pointers are
+ *                skipped.
+ * 
+ * ptrs: array of pointers to the blocks to be freed, reordered
+ * n: number of pointers
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+#if THREAD_SAFE
+    size_t i, count = 0;
+    for (i = 0; i < n; i++)
+    {
+        void *bp = ptrs[i];
+        if (bp == NULL)
+        {
+            continue;
+        }
+
+        block_t *mapped = map_block_of(bp);
+        if (mapped != NULL)
+        {
+            map_free(mapped);
+            continue;
+        }
+
+        arena = arena_of(bp);
+        if (arena == NULL)
+        {
+            continue;
+        }
+        if (arena != tcache.arena)
+        {
+            remote_push(bp);
+            continue;
+        }
+        ptrs[count++] = bp;
+    }
+
+    if (count == 0)
+    {
+        return;
+    }
+    arena = tcache.arena;
+    n = count;
+#endif
+
+    mm_lock();
+    heap_free_batch(ptrs, n);
+    mm_unlock();
+}
+
+/*
+ * heap_malloc_batch: Allocate up to n blocks of the same size in heap. 
+ *                    Slab and mapped sizes are allocated one at a time.
+ *                    Other blocks are carved from a free block that fits 
+ *                    them all. Failing that, they come from the exact-size
+ *                    quick list, then each fitting free block, or the heap
+ *                    extended by what the remaining blocks need, is carved
+ *                    into as many blocks as fit. Return the number of 
+ *                    blocks allocated.
+ * 
+ * size: size of each block
+ * ptrs: array receiving the payload pointers
+ * n: number of blocks
+ */
+static size_t heap_malloc_batch(size_t size, void **ptrs, size_t n)
+{
+    dbg_requires(mm_checkheap(__LINE__));
+
+    size_t count = 0;
+    block_t *block;
+
+    if (arena == NULL) // Initialize heap if it isn't initialized
+    {
+        mm_init();
+    }
+
+    if (size == 0 || n == 0)
+    {
+        return 0;
+    }
+
+    if (is_slab_size(size) 
+            || (mmap_threshold > 0 && size >= mmap_threshold)
+            || size > SIZE_MAX - dsize)
+    {
+        for (; count < n; count++)
+        {
+            if ((ptrs[count] = heap_malloc(size)) == NULL)
+            {
+                break;
+            }
+        }
+        return count;
+    }
+
+    arena->grow_ops += n;
+    size_t asize = round_up(size + wsize, dsize);
+
+    // Carve all blocks from one free block if there is one large enough
+    if (n <= SIZE_MAX / asize && (block = find_fit(n * asize)) != NULL)
+    {
+        count = carve_blocks(block, asize, ptrs, n);
+    }
+
+    while (count < n)
+    {
+        // Reuse recently freed blocks of the exact size
+        block = quick_get(asize);
+        if (block != NULL)
+        {
+            ptrs[count++] = header_to_payload(block);
+            continue;
+        }
+
+        block = find_fit(asize);
+        if (block == NULL && quick_flush())
+        {
+            block = find_fit(asize);
+        }
+
+        // Extend the heap by what the remaining blocks need at once
+        if (block == NULL)
+        {
+            size_t left = n - count;
+            size_t need = (left <= SIZE_MAX / asize) ? left * asize : SIZE_MAX;
+            size_t tail = tail_free_size();
+            block = extend_heap(grow_size(tail < need ? need - tail : 0));
+            if (block == NULL)
+            {
+                break;
+            }
+        }
+
+        count += carve_blocks(block, asize, ptrs + count, n - count);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return count;
+}
+
+/*
+ * heap_free_batch: Free blocks in one sweep. Mapped blocks and slab 
+ *                  objects are freed first, as by heap_free. The other 
+ *                  blocks are sorted by address, and a run of adjacent 
+ *                  blocks is merged into one block, which is released and
+ *                  coalesced with its neighbors once. A block without a 
+ *                  neighbor in the batch goes to its quick list if it can.
+ * 
+ * ptrs: pointers to the blocks to be freed, reordered
+ * n: number of pointers
+ */
+static void heap_free_batch(void **ptrs, size_t n)
+{
+    dbg_requires(mm_checkheap(__LINE__));
+
+    size_t i, j, count = 0;
+    block_t *block;
+    slab_page_t *page;
+
+    for (i = 0; i < n; i++)
+    {
+        void *bp = ptrs[i];
+        if (bp == NULL)
+        {
+            continue;
+        }
+        if ((block = map_block_of(bp)) != NULL)
+        {
+            map_free(block);
+            continue;
+        }
+        if (SLAB_ALLOC && (page = slab_page_of(bp)) != NULL)
+        {
+            slab_free(page, bp);
+            continue;
+        }
+
+        // The block should be marked as allocated
+        dbg_assert(get_alloc(payload_to_header(bp)));
+        if (get_alloc(payload_to_header(bp)))
+        {
+            ptrs[count++] = bp;
+        }
+    }
+
+    sort_pointers(ptrs, count);
+
+    for (i = 0; i < count; i = j)
+    {
+        // Find the run of blocks following this one
+        block = payload_to_header(ptrs[i]);
+        block_t *block_next = find_next(block);
+        for (j = i + 1; j < count && ptrs[j] == header_to_payload(block_next); j++)
+        {
+            block_next = find_next(block_next);
+        }
+
+        if (j - i == 1)
+        {
+            if (!quick_put(block, get_size(block)))
+            {
+                release_block(block);
+            }
+            continue;
+        }
+
+        size_t size = (char *) block_next - (char *) block;
+        write_header(block, size, true, get_prev_alloc(block), get_prev_small(block));
+        release_block(block);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/******** The remaining content below are helper and debug routines ********/
+
+/*
+ * extend_heap: Create new free block given a size at the end of epilogue.
+ *              Update epilogue position and return the newly added
+ *              free block.
+ * 
+ * size: Size for the new free block
+ */
+static block_t *extend_heap(size_t size)
+{
+    void *bp;
+
+    // Allocate a multiple of 16 bytes to maintain alignment
+    size = round_up(size, dsize);
+    if ((bp = mem_region_sbrk(arena->region, size)) == (void *)-1)
+    {
+        return NULL;
+    }
+
+    // Get new free block position from payload
+    block_t *block = payload_to_header(bp);
+    
+    // Get previous block information from old epilogue, 
+    // which has become the new free block's header
+    bool prev_alloc = extract_prev_alloc(block->header);
+    bool prev_small = extract_prev_small(block->header);
+
+    write_header(block, size, false, prev_alloc, prev_small);
+    write_footer(block, size, false, prev_alloc, prev_small);
+
+    // Create new epilogue header
+    block_t *block_next = find_next(block);
+    write_header(block_next, 0, true, false, (get_size(block) <= dsize));
+
+    // Coalesce in case the previous block was free
+    block = coalesce_block(block);
+
+    return block;
+}
+
+/*
+ * tail_free_size: returns the size of the free block at the end of the 
+ *                 heap, or 0 if the last block is allocated. The epilogue
+ *                 is the last word of the heap.
+ */
+static size_t tail_free_size(void)
+{
+    block_t *epilogue = (block_t *) 
+                        ((char *) mem_region_hi(arena->region) + 1 - wsize);
+
+    if (get_prev_alloc(epilogue))
+    {
+        return 0;
+    }
+    if (get_prev_small(epilogue))
+    {
+        return dsize;
+    }
+    return extract_size(*find_prev_footer(epilogue));
+}
+
+/*
+ * grow_size: returns how much to extend the heap by for a request that 
+ *            needs need more bytes, and updates the growth step. An 
+ *            extension within grow_window allocations of the previous one
+ *            doubles the step, a later one resets it to chunksize. Growth
+ *            beyond need is capped by the heap size / grow_budget, but is
+ *            always allowed chunksize.
+ * 
+ * need: bytes the heap must grow by
+ */
+static size_t grow_size(size_t need)
+{
+    if (arena->grow_ops < grow_window)
+    {
+        arena->grow_step = 2 * arena->grow_step;
+    }
+    else
+    {
+        arena->grow_step = chunksize;
+    }
+    arena->grow_ops = 0;
+
+    size_t budget = max(mem_region_size(arena->region) / grow_budget, chunksize);
+    size_t step = (arena->grow_step < budget) ? arena->grow_step : budget;
+    arena->grow_step = step;
+    return max(need, step);
+}
+
+/*
+ * trim_heap: Shrink the free block at the end of the heap to half the trim
+ *            threshold and return the rest to memlib with a negative sbrk.
+ *            Keeping half of the threshold adds hysteresis, so that the 
+ *            heap has to grow that much again before it is trimmed again.
+ * 
+ * block: free block in front of the epilogue
+ */
+static void trim_heap(block_t *block)
+{
+    size_t size = get_size(block);
+    size_t keep = max(round_up(trim_threshold / 2, dsize), 2 * dsize);
+
+    dbg_requires(!get_alloc(block) && size > keep);
+
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_small = get_prev_small(block);
+
+    remove_block_link(block);
+    if (mem_region_sbrk(arena->region, -(intptr_t) (size - keep)) == (void *)-1)
+    {
+        insert_free_block(block);
+        return;
+    }
+
+    write_header(block, keep, false, prev_alloc, prev_small);
+    write_footer(block, keep, false, prev_alloc, prev_small);
+
+    // Create new epilogue header
+    write_header(find_next(block), 0, true, false, false);
+    insert_free_block(block);
+}
+
+/*
+ * quick_put: Keep a block that is being freed in the quick list of its 
+ *            size, still marked allocated. Return false if quick lists 
+ *            are disabled, the block is too large or its list is full.
+ * 
+ * block: allocated block
+ * asize: size of the block
+ */
+static bool quick_put(block_t *block, size_t asize)
+{
+#if QUICK_LISTS
+    size_t i = (asize - quick_min_size) / dsize;
+    if (asize < quick_min_size || i >= QUICK_BINS 
+            || arena->quick_counts[i] >= QUICK_COUNT)
+    {
+        return false;
+    }
+
+    block->data.link.next = arena->quick_lists[i];
+    arena->quick_lists[i] = block;
+    arena->quick_counts[i]++;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * quick_get: Take a block of exactly asize bytes from its quick list. 
+ *            Return the block, which is marked allocated, or null.
+ * 
+ * asize: adjusted block size
+ */
+static block_t *quick_get(size_t asize)
+{
+#if QUICK_LISTS
+    size_t i = (asize - quick_min_size) / dsize;
+    if (asize < quick_min_size || i >= QUICK_BINS 
+            || arena->quick_lists[i] == NULL)
+    {
+        return NULL;
+    }
+
+    block_t *block = arena->quick_lists[i];
+    arena->quick_lists[i] = block->data.link.next;
+    arena->quick_counts[i]--;
+    return block;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * quick_flush: Release the blocks of all quick lists, and the empty slab 
+ *              pages kept for reuse, into the free lists, coalescing them
+ *              with their neighbors. Return true if any block was 
+ *              released.
+ */
+static bool quick_flush(void)
+{
+    bool flushed = false;
+    int c;
+    for (c = 0; SLAB_ALLOC && c < SLAB_CLASSES; c++)
+    {
+        slab_page_t *page = arena->slab_lists[c];
+        while (page != NULL)
+        {
+            slab_page_t *next = page->next;
+            if (page->used == 0)
+            {
+                slab_release(page, c);
+                flushed = true;
+            }
+            page = next;
+        }
+    }
+
+#if QUICK_LISTS
+    size_t i;
+    for (i = 0; i < QUICK_BINS; i++)
+    {
+        block_t *block = arena->quick_lists[i];
+        arena->quick_lists[i] = NULL;
+        arena->quick_counts[i] = 0;
+        while (block != NULL)
+        {
+            block_t *next = block->data.link.next;
+            release_block(block);
+            block = next;
+            flushed = true;
+        }
+    }
+#endif
+    return flushed;
+}
+
+/*
+ * map_malloc: Serve a request from a mapping of its own. The block header
+ *             ends 16 bytes into the mapping, so that the payload is 16 
+ *             byte aligned, and the mapping length is kept in the first 
+ *             word of the mapping. Return the payload, or null if memlib
+ *             can't map.
+ * 
+ * size: requested size
+ */
+static void *map_malloc(size_t size)
+{
+    if (size > SIZE_MAX - MEM_MAP_ALIGN)
+    {
+        return NULL;
+    }
+
+    size_t len = round_up(size + dsize, MEM_MAP_ALIGN);
+    char *base = (char *) mem_mmap(len);
+    if (base == (void *)-1)
+    {
+        return NULL;
+    }
+
+    *(size_t *) base = len;
+    block_t *block = (block_t *) (base + dsize - wsize);
+    block->header = pack(0, true, true, false) | mapped_mask;
+    return header_to_payload(block);
+}
+
+/*
+ * map_free: Return the mapping of a mapped block to memlib
+ * 
+ * block: mapped block
+ */
+static void map_free(block_t *block)
+{
+    dbg_requires((block->header & mapped_mask) != 0);
+
+    mem_munmap(map_base(block), map_length(block));
+}
+
+/*
+ * map_realloc: Resize the mapping of a mapped block for a request without
+ *              copying the payload. Return the payload, which may have 
+ *              moved, or null if memlib can't remap, in which case the 
+ *              block is left untouched.
+ * 
+ * block: mapped block
+ * size: requested size
+ */
+static void *map_realloc(block_t *block, size_t size)
+{
+    if (size > SIZE_MAX - MEM_MAP_ALIGN)
+    {
+        return NULL;
+    }
+
+    size_t len = round_up(size + dsize, MEM_MAP_ALIGN);
+    char *base = (char *) mem_mremap(map_base(block), map_length(block), len);
+    if (base == (void *)-1)
+    {
+        return NULL;
+    }
+
+    *(size_t *) base = len;
+    block = (block_t *) (base + dsize - wsize);
+    return header_to_payload(block);
+}
+
+/*
+ * map_block_of: returns the header of the mapped block with payload bp, 
+ *               or null if bp is not a mapped block. Mapped payloads 
+ *               start 16 bytes into a page, which holds no slab slot, 
+ *               and only their headers carry the mapped bit.
+ * 
+ * bp: pointer returned by malloc
+ */
+static block_t *map_block_of(void *bp)
+{
+    if (((uintptr_t) bp & (MEM_MAP_ALIGN - 1)) != dsize)
+    {
+        return NULL;
+    }
+
+    block_t *block = payload_to_header(bp);
+    return (block->header & mapped_mask) ? block : NULL;
+}
+
+/*
+ * map_base: returns the start of the mapping of a mapped block
+ * 
+ * block: mapped block
+ */
+static char *map_base(block_t *block)
+{
+    return (char *) block + wsize - dsize;
+}
+
+/*
+ * map_length: returns the length of the mapping of a mapped block, kept 
+ *             in the first word of the mapping
+ * 
+ * block: mapped block
+ */
+static size_t map_length(block_t *block)
+{
+    return *(size_t *) map_base(block);
+}
+
+
+/*
+ * coalesce_block: Combine a free block with its adjacent neighbors. 
+ *                 Four possible cases of block arrangements include: 
+ *                 (prev_alloc + next_alloc), (prev_alloc + !next_alloc),
+ *                 (!prev_alloc + next_alloc), (!prev_alloc + !next_alloc).
+ *                 Each case is handled differently. Return a free block  
+ *                 resulting from the coalescence.
+ * 
+ * block: free block to be checked for coalescence
+ */
+static block_t *coalesce_block(block_t *block)
+{
+    dbg_requires(!get_alloc(block));
+
+    size_t size = get_size(block);
+
+    block_t *block_next = find_next(block);
+
+    bool prev_alloc = get_prev_alloc(block);
+    bool next_alloc = get_alloc(block_next);
+
+    if (prev_alloc && next_alloc)              // Case 1
+    {   
+        count_coalesce(1);
+        insert_free_block(block);
+        write_next_header(block);
+    }
+
+    else if (prev_alloc && !next_alloc)        // Case 2
+    {
+        count_coalesce(2);
+        size += get_size(block_next);
+        remove_block_link(block_next);
+
+        write_header(block, size, false, get_prev_alloc(block), get_prev_small(block));
+        write_footer(block, size, false, get_prev_alloc(block), get_prev_small(block));
+
+        insert_free_block(block);
+        write_next_header(block);  
+    }
+
+    else if (!prev_alloc && next_alloc)        // Case 3
+    {
+        count_coalesce(3);
+        block_t *block_prev = find_prev(block);
+         
+        size += get_size(block_prev);
+        remove_block_link(block_prev);
+        write_header(block_prev, size, false, get_prev_alloc(block_prev),get_prev_small(block_prev));
+        write_footer(block_prev, size, false, get_prev_alloc(block_prev),get_prev_small(block_prev));
+        
+        insert_free_block(block_prev);
+        write_next_header(block_prev);
+        block = block_prev;
+    }
+
+    else                                        // Case 4
+    {
+        count_coalesce(4);
+        block_t *block_prev = find_prev(block);
+
+        size += get_size(block_next) + get_size(block_prev);
+
+        remove_block_link(block_prev);
+        remove_block_link(block_next);
+
+        write_header(block_prev, size, false, get_prev_alloc(block_prev), get_prev_small(block_prev));
+        write_footer(block_prev, size, false, get_prev_alloc(block_prev), get_prev_small(block_prev));
+
+        insert_free_block(block_prev);
         write_next_header(block_prev);
         block = block_prev;
     }
 
-    dbg_ensures(!get_alloc(block));
+    dbg_ensures(!get_alloc(block));
+
+    return block;
+}
+
+/*
+ * split_block: Split unused free space of a block into a new free block 
+ *              to decrease internal fragmentation. No need to split if 
+ *              unused free space is less than 16 bytes.
+ *                         
+ * block: allocated block, no longer in any free list, might be larger
+ *        than needed
+ * asize: minimum required size for the block
+ */
+static void split_block(block_t *block, size_t asize)
+{
+    dbg_requires(get_alloc(block));
+
+    if (!get_alloc(block))
+    {
+        return;
+    }
+
+    size_t block_size = get_size(block);
+
+    // Dont split blocks with not enough space
+    if ((block_size - asize) < dsize )
+    {   
+        count_split(false);
+        write_header(block, block_size, true, get_prev_alloc(block), get_prev_small(block));
+       
+        write_next_header(block);
+        return;
+    }
+
+    // Split block
+    count_split(true);
+
+    // Update allocated section of original block
+    write_header(block, asize, true, get_prev_alloc(block), get_prev_small(block));
+
+    // Update free section of original block
+    block_t *block_next = find_next(block);
+    bool prev_small = get_size(block) <= dsize;
+    write_header(block_next, block_size - asize, false, true, prev_small);
+
+    if (get_size(block_next) > dsize)
+    {
+        write_footer(block_next, block_size - asize, false, true, prev_small);
+    }
+
+    coalesce_block(block_next);
+    dbg_ensures(get_alloc(block));
+    return;
+}
+
+/*
+ * carve_blocks: Allocate up to n consecutive blocks of asize bytes from 
+ *               the start of a free block in one pass. The last block 
+ *               takes what is left and splits it off once. Return the 
+ *               number of blocks allocated, at least one.
+ * 
+ * block: free block of at least asize bytes, still in its free list
+ * asize: size of each block
+ * ptrs: array receiving the payload pointers
+ * n: maximum number of blocks
+ */
+static size_t carve_blocks(block_t *block, size_t asize, void **ptrs, size_t n)
+{
+    dbg_requires(!get_alloc(block));
+
+    size_t block_size = get_size(block);
+    size_t count = block_size / asize;
+    if (count > n)
+    {
+        count = n;
+    }
+
+    remove_block_link(block);
+
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_small = get_prev_small(block);
+    size_t i;
+    for (i = 0; i + 1 < count; i++)
+    {
+        write_header(block, asize, true, prev_alloc, prev_small);
+        ptrs[i] = header_to_payload(block);
+        block = find_next(block);
+        prev_alloc = true;
+        prev_small = (asize <= dsize);
+    }
+
+    write_header(block, block_size - i * asize, true, prev_alloc, prev_small);
+    split_block(block, asize);
+    ptrs[i] = header_to_payload(block);
+    return count;
+}
+
+/*
+ * grow_block: Grow an allocated block in place to at least asize bytes. 
+ *             The next block is absorbed if it is free. If the block, or
+ *             its free neighbor, is the last block before the epilogue,
+ *             the heap is extended by the missing amount. Any excess is
+ *             split off again. Return false and leave the block untouched
+ *             if it cannot grow in place.
+ * 
+ * block: allocated block to be grown
+ * asize: minimum required size for the block
+ */
+static bool grow_block(block_t *block, size_t asize)
+{
+    dbg_requires(get_alloc(block));
+
+    block_t *block_next = find_next(block);
+    size_t size = get_size(block);
+    bool next_alloc = get_alloc(block_next);
+
+    if (!next_alloc)
+    {
+        size += get_size(block_next);
+    }
+
+    if (size < asize)
+    {
+        // Only the last block of the heap can take more memory
+        block_t *block_last = next_alloc ? block_next : find_next(block_next);
+        if (get_size(block_last) != 0)
+        {
+            return false;
+        }
+
+        // The new free block is coalesced with a free neighbor, if any
+        if (extend_heap(asize - size) == NULL)
+        {
+            return false;
+        }
+
+        block_next = find_next(block);
+        size = get_size(block) + get_size(block_next);
+    }
+    else if (next_alloc)
+    {
+        // Block already large enough
+        return true;
+    }
+
+    // Absorb the next free block
+    remove_block_link(block_next);
+    write_header(block, size, true, get_prev_alloc(block), get_prev_small(block));
+    write_next_header(block);
+
+    split_block(block, asize);
+    dbg_ensures(get_alloc(block));
+    return true;
+}
+
+/*
+ * alloc_aligned_block: Allocate a block of at least asize bytes whose 
+ *                      payload is aligned to align bytes. A fit with room
+ *                      for the worst case alignment is taken, the leading
+ *                      slack is returned to the free lists as its own 
+ *                      block, and any excess is split off. Return the 
+ *                      allocated block or null if the heap can't grow.
+ * 
+ * asize: minimum required size for the block
+ * align: required payload alignment, a power of two multiple of 16
+ */
+static block_t *alloc_aligned_block(size_t asize, size_t align)
+{
+    // Payloads are 16-byte aligned, so the leading slack is at most 
+    // align - 16 bytes
+    size_t search_size = asize + align - dsize;
+
+    block_t *block = find_fit(search_size);
+    if (block == NULL && quick_flush())
+    {
+        block = find_fit(search_size);
+    }
+    if (block == NULL)
+    {
+        // The free block at the end of the heap coalesces with the new 
+        // memory, so only the rest is needed
+        size_t tail = tail_free_size();
+        block = extend_heap(grow_size(tail < search_size ? search_size - tail 
+                                                         : 0));
+        if (block == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    remove_block_link(block);
+    size_t size = get_size(block);
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_small = get_prev_small(block);
+    write_header(block, size, true, prev_alloc, prev_small);
+
+    // Leading slack is either 0 or at least a minimum block
+    size_t slack = -(uintptr_t) header_to_payload(block) & (align - 1);
+    dbg_assert(slack % dsize == 0);
+
+    if (slack > 0)
+    {
+        // Previous block is allocated, so the slack needs no coalescing
+        block_t *block_aligned = (block_t *) ((char *) block + slack);
+        write_header(block_aligned, size - slack, true, false, slack <= dsize);
+
+        write_header(block, slack, false, prev_alloc, prev_small);
+        if (slack > dsize)
+        {
+            write_footer(block, slack, false, prev_alloc, prev_small);
+        }
+        insert_free_block(block);
+        block = block_aligned;
+    }
+
+    split_block(block, asize);
+    dbg_ensures(get_alloc(block));
+    return block;
+}
+
+/*
+ * is_slab_size: returns true if requests of size are served by slab pages.
+ *               These are the sizes up to slab_max_size whose slot is 
+ *               smaller than the heap block they would get. The others 
+ *               fill a heap block as well as a slot, and a heap block 
+ *               doesn't pin a partly used page.
+ * 
+ * size: requested size
+ */
+static bool is_slab_size(size_t size)
+{
+    return SLAB_ALLOC && size > 0 && size <= slab_max_size 
+            && round_up(size, dsize) < round_up(size + wsize, dsize);
+}
+
+/*
+ * slab_malloc: Take a free slot from the first page of the slab size 
+ *              class of size, adding a new page if the class has none
+ *              with free slots. Return the slot or null if no page can
+ *              be allocated or the class has too few requests yet for
+ *              one, in which case the heap serves the request.
+ * 
+ * size: requested size, 1 to slab_max_size bytes
+ */
+static void *slab_malloc(size_t size)
+{
+    int c = (int) ((size - 1) / dsize);
+    slab_page_t *page = arena->slab_lists[c];
+
+    if (page == NULL)
+    {
+        // A class gets pages once it has seen enough requests, so that a
+        // few small blocks don't each pin a page
+        if (arena->slab_demand[c] < slab_min_demand)
+        {
+            arena->slab_demand[c]++;
+            return NULL;
+        }
+        page = slab_new_page(c);
+        if (page == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    int slot = __builtin_ctzl(page->free_map);
+    page->free_map &= page->free_map - 1;
+    page->used++;
+
+    // Full pages leave the class list until a slot is freed
+    if (page->free_map == 0)
+    {
+        slab_unlink(page, c);
+    }
+
+    return page->slots + (size_t) slot * page->obj_size;
+}
+
+/*
+ * slab_free: Return a slot to its page. A page that was full rejoins its
+ *            class list. A page that becomes empty is freed, unless it
+ *            is the only page of its class with free slots.
+ * 
+ * page: slab page holding the slot
+ * bp: pointer to the slot
+ */
+static void slab_free(slab_page_t *page, void *bp)
+{
+    int c = (int) (page->obj_size / dsize) - 1;
+    size_t slot = (size_t) ((char *) bp - page->slots) / page->obj_size;
+
+    dbg_assert(((page->free_map >> slot) & 1) == 0);
+
+    if (page->free_map == 0)
+    {
+        slab_link(page, c);
+    }
+    page->free_map |= (uint64_t) 1 << slot;
+    page->used--;
+
+    // Keep the last page of the class for the next malloc
+    if (page->used == 0 && (page->prev != NULL || page->next != NULL))
+    {
+        slab_release(page, c);
+    }
+}
+
+/*
+ * slab_release: Give an empty slab page back to the heap
+ * 
+ * page: slab page with no used slots
+ * c: slab size class of the page
+ */
+static void slab_release(slab_page_t *page, int c)
+{
+    dbg_requires(page->used == 0);
+
+    slab_unlink(page, c);
+    slab_map_clear(page);
+    arena->slab_pages--;
+    heap_free(page);
+}
+
+/*
+ * slab_new_page: Allocate a 1 KiB aligned page for slab size class c, 
+ *                mark it in the slab page bitmap, initialize its header
+ *                with all slots free and link it into the class list. 
+ *                Return the page or null, in which case the block is 
+ *                given back.
+ * 
+ * c: slab size class
+ */
+static slab_page_t *slab_new_page(int c)
+{
+    block_t *block = alloc_aligned_block(slab_page_size, slab_page_size);
+    if (block == NULL)
+    {
+        return NULL;
+    }
+
+    slab_page_t *page = (slab_page_t *) header_to_payload(block);
+    if (!slab_map_set(page))
+    {
+        heap_free(page);
+        return NULL;
+    }
+
+    size_t obj_size = (size_t) (c + 1) * dsize;
+    size_t slots = (slab_page_size - wsize - sizeof(slab_page_t)) / obj_size;
+    if (slots > 64)
+    {
+        slots = 64;
+    }
+
+    page->free_map = (slots == 64) ? ~(uint64_t) 0 
+                                   : ((uint64_t) 1 << slots) - 1;
+    page->obj_size = (uint32_t) obj_size;
+    page->used = 0;
+    slab_link(page, c);
+    arena->slab_pages++;
+    return page;
+}
+
+/*
+ * slab_page_of: returns the slab page holding the object bp, or null if 
+ *               bp is not a slab object. The candidate page is found by
+ *               rounding bp down to the page alignment, and is a slab 
+ *               page if its bit is set in the slab page bitmap. The bit 
+ *               of the page of a block the caller owns doesn't change,
+ *               and the bitmap is always written by the allocator, so 
+ *               no lock is needed.
+ * 
+ * bp: pointer returned by malloc
+ */
+static slab_page_t *slab_page_of(void *bp)
+{
+    slab_page_t *page = (slab_page_t *) 
+                        ((uintptr_t) bp & ~(slab_page_size - 1));
+
+    // Slots never start a page, and the page block must be in the heap
+    if ((void *) page == bp || (char *) page < (char *) arena->heap_start + wsize)
+    {
+        return NULL;
+    }
+
+    if (!slab_map_test(page))
+    {
+        return NULL;
+    }
+
+    dbg_assert((char *) bp >= page->slots 
+            && (size_t) ((char *) bp - page->slots) % page->obj_size == 0);
+    return page;
+}
+
+/*
+ * slab_map_index: returns the chunk of the slab page bitmap that covers a
+ *                 page, or -1 if the page is past the pages the bitmap 
+ *                 covers, and stores the bit of the page in the chunk
+ * 
+ * page: 1 KiB aligned address in the arena heap
+ * bit: set to the bit of the page in its chunk
+ */
+static int slab_map_index(void *page, size_t *bit)
+{
+    size_t n = (size_t) ((char *) page - (char *) arena->heap_start) 
+                / slab_page_size;
+    size_t q = n / slab_map_base;
+    if (q == 0)
+    {
+        *bit = n;
+        return 0;
+    }
+
+    // Chunk k > 0 starts at page slab_map_base << (k - 1)
+    int k = 64 - __builtin_clzl(q);
+    if (k >= SLAB_MAP_CHUNKS)
+    {
+        *bit = 0;
+        return -1;
+    }
+    *bit = n - (slab_map_base << (k - 1));
+    return k;
+}
+
+/*
+ * slab_map_test: returns true if a page is marked as a slab page
+ * 
+ * page: 1 KiB aligned address in the arena heap
+ */
+static bool slab_map_test(void *page)
+{
+    size_t bit;
+    int k = slab_map_index(page, &bit);
+    if (k < 0)
+    {
+        return false;
+    }
+
+#if THREAD_SAFE
+    uint64_t *map = __atomic_load_n(&arena->slab_map[k], __ATOMIC_ACQUIRE);
+    uint64_t word = (map == NULL) ? 0 
+                    : __atomic_load_n(&map[bit / 64], __ATOMIC_RELAXED);
+#else
+    uint64_t *map = arena->slab_map[k];
+    uint64_t word = (map == NULL) ? 0 : map[bit / 64];
+#endif
+    return (word >> (bit % 64)) & 1;
+}
+
+/*
+ * slab_map_set: Mark a page as a slab page, allocating the bitmap chunk
+ *               that covers it if needed. Return false if the page is 
+ *               not covered by the bitmap or the chunk can't be 
+ *               allocated.
+ * 
+ * page: 1 KiB aligned payload of an allocated block
+ */
+static bool slab_map_set(void *page)
+{
+    size_t bit;
+    int k = slab_map_index(page, &bit);
+    if (k < 0)
+    {
+        return false;
+    }
+
+    uint64_t *map = arena->slab_map[k];
+    if (map == NULL)
+    {
+        size_t bytes = (slab_map_base << (k > 0 ? k - 1 : 0)) / 8;
+        block_t *block = alloc_aligned_block(round_up(bytes + wsize, dsize),
+                                             dsize);
+        if (block == NULL)
+        {
+            return false;
+        }
+
+        map = (uint64_t *) header_to_payload(block);
+        memset(map, 0, bytes);
+
+        // Unlocked readers see the cleared chunk once they see the pointer
+#if THREAD_SAFE
+        __atomic_store_n(&arena->slab_map[k], map, __ATOMIC_RELEASE);
+#else
+        arena->slab_map[k] = map;
+#endif
+    }
+
+#if THREAD_SAFE
+    __atomic_fetch_or(&map[bit / 64], (uint64_t) 1 << (bit % 64), 
+                        __ATOMIC_RELAXED);
+#else
+    map[bit / 64] |= (uint64_t) 1 << (bit % 64);
+#endif
+    return true;
+}
+
+/*
+ * slab_map_clear: Unmark a slab page that is given back to the heap
+ * 
+ * page: slab page
+ */
+static void slab_map_clear(void *page)
+{
+    size_t bit;
+    int k = slab_map_index(page, &bit);
+    dbg_assert(k >= 0 && arena->slab_map[k] != NULL);
+
+#if THREAD_SAFE
+    __atomic_fetch_and(&arena->slab_map[k][bit / 64], 
+                        ~((uint64_t) 1 << (bit % 64)), __ATOMIC_RELAXED);
+#else
+    arena->slab_map[k][bit / 64] &= ~((uint64_t) 1 << (bit % 64));
+#endif
+}
+
+/*
+ * slab_link: Insert a page at the start of the list of slab size class c
+ * 
+ * page: page with free slots
+ * c: slab size class
+ */
+static void slab_link(slab_page_t *page, int c)
+{
+    slab_page_t **slab_lists = arena->slab_lists;
+
+    page->prev = NULL;
+    page->next = slab_lists[c];
+    if (page->next != NULL)
+    {
+        page->next->prev = page;
+    }
+    slab_lists[c] = page;
+}
+
+/*
+ * slab_unlink: Remove a page from the list of slab size class c
+ * 
+ * page: page in the list
+ * c: slab size class
+ */
+static void slab_unlink(slab_page_t *page, int c)
+{
+    if (page->prev == NULL)
+    {
+        arena->slab_lists[c] = page->next;
+    } else
+    {
+        page->prev->next = page->next;
+    }
+
+    if (page->next != NULL)
+    {
+        page->next->prev = page->prev;
+    }
+    page->prev = NULL;
+    page->next = NULL;
+}
+
+/*
+ * mm_lock: Take the lock of the current arena in the thread-safe build
+ */
+static void mm_lock(void)
+{
+#if THREAD_SAFE
+    pthread_mutex_lock(&arena->lock);
+#endif
+}
+
+/*
+ * mm_unlock: Release the lock of the current arena in the thread-safe build
+ */
+static void mm_unlock(void)
+{
+#if THREAD_SAFE
+    pthread_mutex_unlock(&arena->lock);
+#endif
+}
+
+#if THREAD_SAFE
+/*
+ * arena_home: returns the arena the calling thread allocates from, 
+ *             assigning one if the thread has none in the current heap
+ */
+static arena_t *arena_home(void)
+{
+    if (tcache.epoch != heap_epoch || tcache.arena == NULL)
+    {
+        tcache_reset();
+    }
+    return tcache.arena;
+}
+
+/*
+ * arena_assign: Pick the arena of a new thread round-robin, creating it in
+ *               a new heap region on first use. Threads fall back to the
+ *               first arena if no more regions can be created.
+ */
+static arena_t *arena_assign(void)
+{
+    unsigned int i = __atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED);
+    int k = (int) (i % MM_ARENAS);
+
+    // Creating an arena changes the current arena, which free has set
+    arena_t *current = arena;
+
+    pthread_mutex_lock(&arena_lock);
+    if (arena_count == 0 && !mm_init())
+    {
+        pthread_mutex_unlock(&arena_lock);
+        return NULL;
+    }
+
+    while (arena_count <= k)
+    {
+        int region = mem_region_new();
+        if (region != arena_count || !arena_init(region))
+        {
+            k = 0;
+            break;
+        }
+        arenas[arena_count++] = arena;
+    }
+    arena_t *a = arenas[k];
+    pthread_mutex_unlock(&arena_lock);
+
+    arena = current;
+    return a;
+}
+
+/*
+ * arena_of: returns the arena whose heap region holds bp, or null if bp
+ *           is not in the heap
+ * 
+ * bp: pointer returned by malloc
+ */
+static arena_t *arena_of(void *bp)
+{
+    if (MM_ARENAS == 1)
+    {
+        return arenas[0];
+    }
+
+    int region = mem_region_of(bp);
+    return (region < 0 || region >= arena_count) ? NULL : arenas[region];
+}
+
+/*
+ * remote_push: Push a block freed by a thread of another arena on the 
+ *              remote free stack of the current arena without locking
+ * 
+ * bp: pointer to the block payload
+ */
+static void remote_push(void *bp)
+{
+    void *head = __atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED);
+    do
+    {
+        *(void **) bp = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_free, &head, bp, 
+                        true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * remote_drain: Take the whole remote free stack of the current arena and
+ *               free its blocks through heap_free, so that they coalesce
+ *               with their neighbors. The arena lock must be held.
+ */
+static void remote_drain(void)
+{
+    if (__atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED) == NULL)
+    {
+        return;
+    }
+
+    void *bp = __atomic_exchange_n(&arena->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while (bp != NULL)
+    {
+        void *next = *(void **) bp;
+        heap_free(bp);
+        bp = next;
+    }
+}
+
+/*
+ * tcache_class: returns the thread cache bin of the blocks that malloc 
+ *               would hand out for a request, or -1 if requests of this
+ *               size are not cached. Bins are indexed by slot size for 
+ *               slab requests and by block size otherwise.
+ * 
+ * size: requested size
+ */
+static int tcache_class(size_t size)
+{
+    if (size == 0 || size > TCACHE_BINS * dsize)
+    {
+        return -1;
+    }
+
+    if (is_slab_size(size))
+    {
+        return (int) (round_up(size, dsize) / dsize) - 1;
+    }
+
+    size_t key = round_up(size + wsize, dsize);
+    int i = (int) (key / dsize) - 1;
+    if (SLAB_ALLOC && key <= slab_max_size)
+    {
+        return TCACHE_BINS + i;
+    }
+    return (i < TCACHE_BINS) ? i : -1;
+}
+
+/*
+ * tcache_block_class: returns the thread cache bin of an allocated block
+ *                     or slab slot, or -1 if it can't be cached. Heap 
+ *                     blocks of slab sizes get the bins past TCACHE_BINS,
+ *                     as they are too small for the slab requests of 
+ *                     their size. This reads only the slab page bitmap 
+ *                     and the header of the block being freed, which no
+ *                     other thread may resize, so no lock is needed.
+ * 
+ * bp: pointer to the block payload
+ */
+static int tcache_block_class(void *bp)
+{
+    size_t key;
+    slab_page_t *page;
+
+    if (SLAB_ALLOC && (page = slab_page_of(bp)) != NULL)
+    {
+        key = page->obj_size;
+    } else
+    {
+        key = get_size(payload_to_header(bp));
+        if (SLAB_ALLOC && key <= slab_max_size)
+        {
+            return TCACHE_BINS + (int) (key / dsize) - 1;
+        }
+    }
+
+    int i = (int) (key / dsize) - 1;
+    return (i < TCACHE_BINS) ? i : -1;
+}
+
+/*
+ * tcache_get: Take a block for a request from the cache of the calling 
+ *             thread without locking. Return the block or null.
+ * 
+ * size: requested size
+ */
+static void *tcache_get(size_t size)
+{
+    int i = tcache_class(size);
+    if (i < 0 || tcache.epoch != heap_epoch || tcache.bins[i] == NULL)
+    {
+        return NULL;
+    }
+
+    void *bp = tcache.bins[i];
+    tcache.bins[i] = *(void **) bp;
+    tcache.counts[i]--;
+    return bp;
+}
+
+/*
+ * tcache_put: Keep a freed block in the cache of the calling thread 
+ *             without locking. Return false if its bin is full or the 
+ *             block can't be cached.
+ * 
+ * bp: pointer to the block payload
+ * i: bin of the block, see tcache_block_class, or -1
+ */
+static bool tcache_put(void *bp, int i)
+{
+    if (tcache.epoch != heap_epoch)
+    {
+        tcache_reset();
+    }
+
+    if (i < 0 || tcache.counts[i] >= TCACHE_COUNT)
+    {
+        return false;
+    }
+
+    *(void **) bp = tcache.bins[i];
+    tcache.bins[i] = bp;
+    tcache.counts[i]++;
+    return true;
+}
+
+/*
+ * tcache_reset: Empty the cache of the calling thread, dropping blocks 
+ *               of a previous heap, assign the thread an arena of the 
+ *               current heap, and register the cache to be flushed when
+ *               the thread exits.
+ */
+static void tcache_reset(void)
+{
+    int i;
+    for (i = 0; i < TCACHE_ALL_BINS; i++)
+    {
+        tcache.bins[i] = NULL;
+        tcache.counts[i] = 0;
+    }
+
+    if (tcache.epoch == 0)
+    {
+        pthread_once(&tcache_key_once, tcache_key_create);
+        pthread_setspecific(tcache_key, &tcache);
+    }
+    tcache.arena = arena_assign();
+    tcache.epoch = heap_epoch;
+}
+
+/*
+ * tcache_key_create: Create the key whose destructor flushes thread caches
+ */
+static void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_flush);
+}
+
+/*
+ * tcache_flush: Free all blocks of a thread cache back to the heap. Runs
+ *               as destructor of tcache_key when the thread exits.
+ * 
+ * arg: cache of the exiting thread
+ */
+static void tcache_flush(void *arg)
+{
+    tcache_t *cache = (tcache_t *) arg;
+    if (cache->epoch != heap_epoch)
+    {
+        return;
+    }
+
+    int i;
+    for (i = 0; i < TCACHE_ALL_BINS; i++)
+    {
+        while (cache->bins[i] != NULL)
+        {
+            void *bp = cache->bins[i];
+            cache->bins[i] = *(void **) bp;
+            arena = arena_of(bp);
+            mm_lock();
+            heap_free(bp);
+            mm_unlock();
+        }
+        cache->counts[i] = 0;
+    }
+}
+#endif
+
+/*
+ * remove_block_link: Remove a block from the free list it originally 
+ *                    resides in. If block if small, unlink it from 
+ *                    small_free_list in constant time.
+ *  
+ * block: target block to be removed                  
+ */
+static void remove_block_link(block_t *block)
+{   
+
+    size_t block_size = get_size(block);
+
+    int c = get_stats_class(block_size);
+    arena->class_blocks[c]--;
+    arena->class_bytes[c] -= block_size;
+    if (arena->class_blocks[c] == 0)
+    {
+        arena->class_max[c] = 0;
+    }
+
+    // Check if block is in small_free_list
+    if (block_size <= dsize)
+    {
+        // Small blocks out of offset range were never listed
+        if (!small_linkable(block))
+        {
+            return;
+        }
+
+        block_t *small_prev = small_from_offset(block->data.small.prev);
+        block_t *small_next = small_from_offset(block->data.small.next);
+
+        if (small_prev == NULL)
+        {
+             // Remove from the start
+            arena->small_blocks_list = small_next;
+        } else
+        {
+            // Remove from the middle or end
+            small_prev->data.small.next = block->data.small.next;
+        }
+
+        if (small_next != NULL)
+        {
+            small_next->data.small.prev = block->data.small.prev;
+        }
+        return;
+    }
+
+    // Find the correct size class
+    int i = get_size_class(block_size);
+
+    if (i == tree_class)
+    {
+        tree_remove(block);
+        return;
+    }
+
+    block_t *prev_node = block->data.link.prev;
+    block_t *next_node = block->data.link.next;
+
+    // Removing from one single list, the size class becomes empty
+    if (prev_node == NULL && next_node == NULL)
+    {
+        arena->free_list[i] = NULL;
+        clear_class_map(i);
+    } 
+    // Removing from start
+    else if (prev_node == NULL && next_node != NULL)
+    {
+        next_node->data.link.prev = NULL;
+        arena->free_list[i] = next_node;
+    }
+    // Removing from middle
+    else if (prev_node != NULL && next_node != NULL)
+    {
+        prev_node->data.link.next = next_node;
+        next_node->data.link.prev = prev_node;
+    }
+    // Removing from end
+    else 
+    {
+        prev_node->data.link.next = NULL;
+    }
+    return;
+}
+
+/*
+ * insert_free_block: Insert a block into the start of the correct free list.
+ *                    If the block is small, insert into small_free_list
+ *  
+ * block: target block to be inserted                  
+ */
+static void insert_free_block(block_t *block)
+{   
+
+    size_t block_size = get_size(block);
+
+    int c = get_stats_class(block_size);
+    arena->class_blocks[c]++;
+    arena->class_bytes[c] += block_size;
+    arena->class_max[c] = max(arena->class_max[c], block_size);
+
+    if (block_size <= dsize)
+    {
+        // Leave the block to boundary tags if it can't be encoded
+        if (!small_linkable(block))
+        {
+            return;
+        }
+
+        block->data.small.next = small_to_offset(arena->small_blocks_list);
+        block->data.small.prev = 0;
+
+        if (arena->small_blocks_list != NULL)
+        {
+            arena->small_blocks_list->data.small.prev = small_to_offset(block);
+        }
+        arena->small_blocks_list = block;
+        return;
+    }
+
+    // Find the correct size class
+    int i = get_size_class(block_size);
+
+    if (i == tree_class)
+    {
+        tree_insert(block);
+        return;
+    }
+
+    // If list is empty, insert into empty list
+    if (arena->free_list[i] == NULL)
+    {
+        block->data.link.prev = NULL;
+        block->data.link.next = NULL;
+        arena->free_list[i] = block;
+        set_class_map(i);
+        return;
+    } 
+
+    
+    block_t *block_target = arena->free_list[i];
+    block_t *prev = NULL;
+   
+    if (prev == NULL && block_target != NULL)
+    { 
+        // Insert into start
+        block->data.link.prev = NULL;
+        block->data.link.next = block_target;
+        block_target->data.link.prev = block;
+        arena->free_list[i] = block;
+    }   
+
+    return;
+}
+
+/*
+ * find_fit: Look for free block in small_free_list if size is 16 bytes. 
+ *           For larger size, search the free list of closest size class 
+ *           with the current fit policy. Any block of a larger size class
+ *           fits, so move to the next non-empty class found in the class
+ *           bitmaps and take its first block, or its best block under the
+ *           best fit policies. The tree of the largest size class always
+ *           gives the best fit. With TLSF_INDEX only the head of the 
+ *           closest class is probed, which keeps the search constant time.
+ *           An MM_INSTRUMENT build counts the blocks each search inspects.
+ *           Return the found block or null
+ * 
+ * asize: The size that we need
+ */
+static block_t *find_fit(size_t asize)
+{
+    block_t *block = find_fit_block(asize);
+    count_fit(block);
+    return block;
+}
+
+/*
+ * find_fit_block: Search for the free block used by find_fit
+ * 
+ * asize: The size that we need
+ */
+static block_t *find_fit_block(size_t asize)
+{
+
+    // Use small block if asize fits
+    // Use free_list blocks if small_blocks_list is empty
+    if (asize <= dsize)
+    {
+        if (arena->small_blocks_list != NULL)
+        {
+            count_probes(1);
+            return arena->small_blocks_list;
+        }
+    }
+
+    // Find the starting size class
+    int i = get_size_class(asize);
+
+    // Blocks in the starting class may be smaller than asize
+    block_t *block = search_class(i, asize, class_probes);
+    if (block != NULL)
+    {
+        return block;
+    }
+
+    // Look for the next non-empty size class
+    i = find_class_above(i);
+    if (i < 0)
+    {
+        return NULL; // no fit found
+    }
+
+    if (fit_policy == MM_FIT_FIRST && i != tree_class)
+    {
+        count_probes(1);
+        return arena->free_list[i];
+    }
+
+    return search_class(i, asize, SIZE_MAX);
+}
+
+/*
+ * search_class: Look for the block of size class i to use for asize under
+ *               the current fit policy. Return the found block or null
+ * 
+ * i: size class index
+ * asize: The size that we need
+ * max_probes: The maximum number of blocks looked at
+ */
+static block_t *search_class(int i, size_t asize, size_t max_probes)
+{
+    block_t *best = NULL;
+    size_t best_size = SIZE_MAX;
+    size_t probes = 0;
+    size_t found = 0;
+    size_t max_found = SIZE_MAX;
+
+    if (i == tree_class)
+    {
+        return tree_find_fit(asize);
+    }
+
+    if (fit_policy == MM_FIT_FIRST)
+    {
+        max_found = 1;
+    }
+    else if (fit_policy == MM_FIT_BEST_OF_N)
+    {
+        max_found = fit_candidates;
+    }
+
+    for (block_t *block = arena->free_list[i]; block != NULL && probes < max_probes;
+                                    block = block->data.link.next)
+    {
+        probes++;
+        size_t size = get_size(block);
+        if (size < asize)
+        {
+            continue;
+        }
+
+        if (size < best_size)
+        {
+            best = block;
+            best_size = size;
+
+            // Nothing beats an exact fit
+            if (size == asize)
+            {
+                break;
+            }
+        }
+
+        found++;
+        if (found >= max_found)
+        {
+            break;
+        }
+    }
+
+    count_probes(probes);
+    return best;
+}
+
+/*
+ * tree_less: returns true if block a comes before block b in the splay 
+ *            tree, ordering by size and then by address so keys are unique
+ * 
+ * a, b: blocks to compare
+ */
+static bool tree_less(block_t *a, block_t *b)
+{
+    size_t a_size = get_size(a);
+    size_t b_size = get_size(b);
+    return (a_size < b_size) || (a_size == b_size && a < b);
+}
+
+/*
+ * tree_insert: Insert a free block into the splay tree of the largest 
+ *              size class, then splay it to the root.
+ * 
+ * block: target block to be inserted
+ */
+static void tree_insert(block_t *block)
+{
+    block_t *node = arena->free_list[tree_class];
+    block_t *parent = NULL;
+
+    if (node == NULL || tree_less(arena->tree_max, block))
+    {
+        arena->tree_max = block;
+    }
+
+    while (node != NULL)
+    {
+        parent = node;
+        node = tree_less(block, node) ? node->data.node.left 
+                                      : node->data.node.right;
+    }
+
+    block->data.node.left = NULL;
+    block->data.node.right = NULL;
+    block->data.node.parent = parent;
+
+    if (parent == NULL)
+    {
+        arena->free_list[tree_class] = block;
+        set_class_map(tree_class);
+        return;
+    }
 
-    return block;
+    if (tree_less(block, parent))
+    {
+        parent->data.node.left = block;
+    } else
+    {
+        parent->data.node.right = block;
+    }
+    tree_splay(block);
 }
 
 /*
- * split_block: Split unused free space of a block into a new free block 
- *              to decrease internal fragmentation. No need to split if 
- *              unused free space is less than 16 bytes.
- *                         
- * block: newly allocated block, might be larger than needed
- * asize: minimum required size for the block
+ * tree_remove: Remove a free block from the splay tree of the largest 
+ *              size class. The block is splayed to the root first and
+ *              replaced by the minimum of its right subtree. When the 
+ *              largest block is removed, the new rightmost node is 
+ *              splayed to the root, which pays for finding it.
+ * 
+ * block: target block to be removed
  */
-static void split_block(block_t *block, size_t asize)
+static void tree_remove(block_t *block)
 {
-    dbg_requires(get_alloc(block));
+    tree_splay(block);
 
-    if (!get_alloc(block))
+    block_t *left = block->data.node.left;
+    block_t *right = block->data.node.right;
+
+    if (left == NULL)
     {
-        return;
+        tree_replace(block, right);
+    } else if (right == NULL)
+    {
+        tree_replace(block, left);
+    } else
+    {
+        block_t *min = tree_min(right);
+        if (min->data.node.parent != block)
+        {
+            tree_replace(min, min->data.node.right);
+            min->data.node.right = right;
+            right->data.node.parent = min;
+        }
+        tree_replace(block, min);
+        min->data.node.left = left;
+        left->data.node.parent = min;
     }
 
-    remove_block_link(block);
+    if (arena->free_list[tree_class] == NULL)
+    {
+        arena->tree_max = NULL;
+        clear_class_map(tree_class);
+    } else if (block == arena->tree_max)
+    {
+        arena->tree_max = tree_rightmost(arena->free_list[tree_class]);
+        tree_splay(arena->tree_max);
+    }
+}
 
-    size_t block_size = get_size(block);
+/*
+ * tree_find_fit: Look for the smallest block of at least asize bytes in 
+ *                the splay tree, taking the lowest address among equal 
+ *                sizes. The found block is splayed to the root. Return 
+ *                the found block or null
+ * 
+ * asize: The size that we need
+ */
+static block_t *tree_find_fit(size_t asize)
+{
+    block_t *node = arena->free_list[tree_class];
+    block_t *best = NULL;
+    size_t probes = 0;
 
-    // Dont split blocks with not enough space
-    if ((block_size - asize) < dsize )
-    {   
-        write_header(block, block_size, true, get_prev_alloc(block), get_prev_small(block));
-       
-        write_next_header(block);
-        return;
+    while (node != NULL)
+    {
+        probes++;
+        if (get_size(node) >= asize)
+        {
+            best = node;
+            node = node->data.node.left;
+        } else
+        {
+            node = node->data.node.right;
+        }
     }
 
-    // Split block
-    // Update allocated section of original block
-    write_header(block, asize, true, get_prev_alloc(block), get_prev_small(block));
+    count_probes(probes);
+    if (best != NULL)
+    {
+        tree_splay(best);
+    }
+    return best;
+}
 
-    // Update free section of original block
-    block_t *block_next = find_next(block);
-    bool prev_small = get_size(block) <= dsize;
-    write_header(block_next, block_size - asize, false, true, prev_small);
+/*
+ * tree_rotate_left: Rotate the right child of x above x
+ * 
+ * x: tree node with a right child
+ */
+static void tree_rotate_left(block_t *x)
+{
+    block_t *y = x->data.node.right;
 
-    if (get_size(block_next) > dsize)
+    x->data.node.right = y->data.node.left;
+    if (y->data.node.left != NULL)
     {
-        write_footer(block_next, block_size - asize, false, true, prev_small);
+        y->data.node.left->data.node.parent = x;
     }
-
-    coalesce_block(block_next);
-    dbg_ensures(get_alloc(block));
-    return;
+    tree_replace(x, y);
+    y->data.node.left = x;
+    x->data.node.parent = y;
 }
 
 /*
- * remove_block_link: Remove a block from the free list it originally 
- *                    resides in. If block if small, check small_free_list
- *  
- * block: target block to be removed                  
+ * tree_rotate_right: Rotate the left child of x above x
+ * 
+ * x: tree node with a left child
  */
-static void remove_block_link(block_t *block)
-{   
+static void tree_rotate_right(block_t *x)
+{
+    block_t *y = x->data.node.left;
 
-    size_t block_size = get_size(block);
+    x->data.node.left = y->data.node.right;
+    if (y->data.node.right != NULL)
+    {
+        y->data.node.right->data.node.parent = x;
+    }
+    tree_replace(x, y);
+    y->data.node.right = x;
+    x->data.node.parent = y;
+}
 
-    // Check if block is in small_free_list
-    if (block_size <= dsize)
+/*
+ * tree_splay: Move x to the root of the tree with zig, zig-zig and 
+ *             zig-zag rotations
+ * 
+ * x: tree node to splay
+ */
+static void tree_splay(block_t *x)
+{
+    block_t *parent;
+    while ((parent = x->data.node.parent) != NULL)
     {
-        block_t *small_prev = NULL;
-        block_t *small_cur = small_blocks_list;
+        block_t *grand = parent->data.node.parent;
+        bool x_left = (parent->data.node.left == x);
 
-        for (; small_cur != NULL; small_cur = small_cur->data.link.next)
+        if (grand == NULL)
         {
-            if (small_cur == block)
+            // Zig
+            if (x_left)
             {
-                break;
+                tree_rotate_right(parent);
+            } else
+            {
+                tree_rotate_left(parent);
             }
-            small_prev = small_cur;
-        }
-
-        if (small_prev == NULL)
+        } else if (x_left == (grand->data.node.left == parent))
         {
-             // Remove from the start
-            small_blocks_list = small_blocks_list->data.link.next;
+            // Zig-zig
+            if (x_left)
+            {
+                tree_rotate_right(grand);
+                tree_rotate_right(parent);
+            } else
+            {
+                tree_rotate_left(grand);
+                tree_rotate_left(parent);
+            }
         } else
         {
-            // Remove from the middle
-            small_prev->data.link.next = small_cur->data.link.next;
+            // Zig-zag
+            if (x_left)
+            {
+                tree_rotate_right(parent);
+                tree_rotate_left(grand);
+            } else
+            {
+                tree_rotate_left(parent);
+                tree_rotate_right(grand);
+            }
         }
-        return;
     }
+}
 
-    block_t *prev_node = block->data.link.prev;
-    block_t *next_node = block->data.link.next;
-    int i;
+/*
+ * tree_replace: Put subtree v in the place of subtree u under u's parent
+ * 
+ * u: tree node being replaced
+ * v: tree node taking its place, may be null
+ */
+static void tree_replace(block_t *u, block_t *v)
+{
+    block_t *parent = u->data.node.parent;
 
-    // Find the correct size class
-    for (i = 0; i < FREE_LIST_SIZE; i ++)
+    if (parent == NULL)
     {
-        // Already reach the last size class 
-        // Block must belong here
-        if (i == FREE_LIST_SIZE - 1)
-        {
-          break;      
-        } 
+        arena->free_list[tree_class] = v;
+    } else if (parent->data.node.left == u)
+    {
+        parent->data.node.left = v;
+    } else
+    {
+        parent->data.node.right = v;
+    }
 
-        // Check if a block falls into the current size class  
-        if ((block_size >= (1L << (i + MIN_SIZE_CLASS))) 
-                && (block_size < (1L << (i + (MIN_SIZE_CLASS + 1)))))
-        {
-            break;
-        }
-        
+    if (v != NULL)
+    {
+        v->data.node.parent = parent;
     }
+}
 
-    // Removing from one single list
-    if (prev_node == NULL && next_node == NULL)
+/*
+ * tree_min: returns the leftmost node of the subtree rooted at u
+ * 
+ * u: subtree root, not null
+ */
+static block_t *tree_min(block_t *u)
+{
+    while (u->data.node.left != NULL)
     {
-        free_list[i] = NULL;
-    } 
-    // Removing from start
-    else if (prev_node == NULL && next_node != NULL)
+        u = u->data.node.left;
+    }
+    return u;
+}
+
+/*
+ * tree_rightmost: returns the rightmost node of the subtree rooted at u
+ * 
+ * u: subtree root, not null
+ */
+static block_t *tree_rightmost(block_t *u)
+{
+    while (u->data.node.right != NULL)
     {
-        next_node->data.link.prev = NULL;
-        free_list[i] = next_node;
+        u = u->data.node.right;
     }
-    // Removing from middle
-    else if (prev_node != NULL && next_node != NULL)
+    return u;
+}
+
+/*
+ * tree_next: returns the in-order successor of u, or null if u is the
+ *            last node
+ * 
+ * u: tree node
+ */
+static block_t *tree_next(block_t *u)
+{
+    if (u->data.node.right != NULL)
     {
-        prev_node->data.link.next = next_node;
-        next_node->data.link.prev = prev_node;
+        return tree_min(u->data.node.right);
     }
-    // Removing from end
-    else 
+
+    block_t *parent = u->data.node.parent;
+    while (parent != NULL && parent->data.node.right == u)
     {
-        prev_node->data.link.next = NULL;
+        u = parent;
+        parent = parent->data.node.parent;
     }
-    return;
+    return parent;
 }
 
 /*
- * insert_free_block: Insert a block into the start of the correct free list.
- *                    If the block is small, insert into small_free_list
- *  
- * block: target block to be inserted                  
+ * get_size_class: returns the index of the free list holding blocks of 
+ *                 a given size, floor(log2(size)) - 4 capped at the last
+ *                 size class.
+ * 
+ * size: block size, at least 16 bytes
  */
-static void insert_free_block(block_t *block)
-{   
+static int get_size_class(size_t size)
+{
+    dbg_requires(size >= dsize);
 
-    size_t block_size = get_size(block);
-    int i;
+    int i = (int) (63 - __builtin_clzl(size)) - MIN_SIZE_CLASS;
+#if TLSF_INDEX
+    // Sizes below 2^(4 + SL_BITS) map linearly in 16-byte steps
+    if (i < SL_BITS)
+    {
+        return (int) (size >> MIN_SIZE_CLASS);
+    }
 
-    if (block_size <= dsize)
+    // Sub-class is given by the SL_BITS bits below the leading one
+    int fl = i - SL_BITS + 1;
+    int sl = (int) (size >> (i + MIN_SIZE_CLASS - SL_BITS)) - SL_COUNT;
+    return fl * SL_COUNT + sl;
+#else
+    return (i < FREE_LIST_SIZE - 1) ? i : FREE_LIST_SIZE - 1;
+#endif
+}
+
+/*
+ * set_class_map: mark a size class as non-empty in the class bitmaps
+ * 
+ * i: size class index
+ */
+static void set_class_map(int i)
+{
+#if TLSF_INDEX
+    arena->sl_map[i / SL_COUNT] |= (uint8_t) (1U << (i % SL_COUNT));
+    arena->fl_map |= (uint64_t) 1 << (i / SL_COUNT);
+#else
+    arena->free_list_map |= 1U << i;
+#endif
+}
+
+/*
+ * clear_class_map: mark a size class as empty in the class bitmaps
+ * 
+ * i: size class index
+ */
+static void clear_class_map(int i)
+{
+#if TLSF_INDEX
+    arena->sl_map[i / SL_COUNT] &= (uint8_t) ~(1U << (i % SL_COUNT));
+    if (arena->sl_map[i / SL_COUNT] == 0)
     {
-        block->data.link.next = small_blocks_list;
-        small_blocks_list = block;
-        return;
+        arena->fl_map &= ~((uint64_t) 1 << (i / SL_COUNT));
     }
+#else
+    arena->free_list_map &= ~(1U << i);
+#endif
+}
 
-    // Find the correct size class
-    for (i = 0; i < FREE_LIST_SIZE; i ++)
+/*
+ * get_class_map: returns true when a size class is marked non-empty
+ * 
+ * i: size class index
+ */
+static bool get_class_map(int i)
+{
+#if TLSF_INDEX
+    return (arena->sl_map[i / SL_COUNT] >> (i % SL_COUNT)) & 1U;
+#else
+    return (arena->free_list_map >> i) & 1U;
+#endif
+}
+
+/*
+ * find_class_above: returns the smallest non-empty size class larger 
+ *                   than i, or -1 if there is none.
+ * 
+ * i: size class index
+ */
+static int find_class_above(int i)
+{
+#if TLSF_INDEX
+    int fl = i / SL_COUNT;
+    int sl = i % SL_COUNT;
+
+    // Larger sub-class with the same first level
+    unsigned int sl_larger = arena->sl_map[fl] & ~((2U << sl) - 1);
+    if (sl_larger != 0)
     {
-        // Already reach the last size class
-        // Block must belong here
-        if (i == FREE_LIST_SIZE - 1)
-        {
-          break;      
-        } 
+        return fl * SL_COUNT + __builtin_ctz(sl_larger);
+    }
+
+    // Smallest sub-class of the next non-empty first level
+    uint64_t fl_larger = arena->fl_map & ~(((uint64_t) 2 << fl) - 1);
+    if (fl_larger == 0)
+    {
+        return -1;
+    }
+
+    fl = __builtin_ctzll(fl_larger);
+    return fl * SL_COUNT + __builtin_ctz(arena->sl_map[fl]);
+#else
+    uint32_t larger = arena->free_list_map & ~((2U << i) - 1);
+    return (larger == 0) ? -1 : __builtin_ctz(larger);
+#endif
+}
+
+/*
+ * get_stats_class: returns the mm_stats class of a free block of a given
+ *                  size, floor(log2(size)) - 4 capped at the last class,
+ *                  whatever the free list index
+ * 
+ * size: block size, at least 16 bytes
+ */
+static int get_stats_class(size_t size)
+{
+    int i = (int) (63 - __builtin_clzl(size)) - MIN_SIZE_CLASS;
+    return (i < MM_STATS_CLASSES - 1) ? i : MM_STATS_CLASSES - 1;
+}
+
+/*
+ * largest_free_size: returns the size of the largest free block of the 
+ *                    current arena, or 0 if there is none, from counters
+ *                    alone. The tree of the last size class caches its 
+ *                    largest block, which is exact. Below the tree, the 
+ *                    maximum of the last non-empty mm_stats class is 
+ *                    taken, which may exceed the largest block left in 
+ *                    that class but not the end of its size range.
+ */
+static size_t largest_free_size(void)
+{
+    if (arena->tree_max != NULL)
+    {
+        return get_size(arena->tree_max);
+    }
 
-        // Check if a block falls into the current size class  
-        if ((block_size >= (1L << (i + MIN_SIZE_CLASS))) 
-                && (block_size < (1L << (i + (MIN_SIZE_CLASS + 1)))))
+    int c;
+    for (c = MM_STATS_CLASSES - 1; c >= 0; c--)
+    {
+        if (arena->class_blocks[c] != 0)
         {
-            break;
+            return arena->class_max[c];
         }
-        
     }
+    return 0;
+}
 
-    // If list is empty, insert into empty list
-    if (free_list[i] == NULL)
+/*
+ * add_arena_stats: Add the state of the current arena to a heap snapshot
+ * 
+ * stats: snapshot to add to
+ */
+static void add_arena_stats(struct mm_stats *stats)
+{
+    int i;
+    for (i = 0; i < MM_STATS_CLASSES; i++)
     {
-        block->data.link.prev = NULL;
-        block->data.link.next = NULL;
-        free_list[i] = block;
-        return;
-    } 
+        stats->class_blocks[i] += arena->class_blocks[i];
+        stats->class_bytes[i] += arena->class_bytes[i];
+        stats->free_blocks += arena->class_blocks[i];
+        stats->free_bytes += arena->class_bytes[i];
+    }
 
-    
-    block_t *block_target = free_list[i];
-    block_t *prev = NULL;
-   
-    if (prev == NULL && block_target != NULL)
-    { 
-        // Insert into start
-        block->data.link.prev = NULL;
-        block->data.link.next = block_target;
-        block_target->data.link.prev = block;
-        free_list[i] = block;
-    }   
+#if QUICK_LISTS
+    for (i = 0; i < QUICK_BINS; i++)
+    {
+        stats->quick_blocks += arena->quick_counts[i];
+        stats->quick_bytes += arena->quick_counts[i] 
+                                * (quick_min_size + (size_t) i * dsize);
+    }
+#endif
+
+    stats->heap_size += mem_region_size(arena->region);
+    stats->largest_free = max(stats->largest_free, largest_free_size());
+    stats->wilderness += tail_free_size();
+    stats->slab_pages += arena->slab_pages;
+}
+
+/*
+ * add_arena_counters: Add the hot path counters of the current arena
+ * 
+ * counters: counters to add to
+ */
+static void add_arena_counters(struct mm_instrument *counters)
+{
+#if MM_INSTRUMENT
+    struct mm_instrument *c = &arena->counters;
+    int i;
+
+    counters->fit_searches += c->fit_searches;
+    counters->fit_misses += c->fit_misses;
+    counters->fit_probes += c->fit_probes;
+    for (i = 0; i < MM_PROBE_BUCKETS; i++)
+    {
+        counters->probe_hist[i] += c->probe_hist[i];
+    }
+    for (i = 0; i < 4; i++)
+    {
+        counters->coalesce[i] += c->coalesce[i];
+    }
+    counters->splits += c->splits;
+    counters->split_declined += c->split_declined;
+#endif
+}
 
-    return;
+/*
+ * count_probes: Add blocks inspected to the current fit search in an 
+ *               MM_INSTRUMENT build. Other builds count nothing.
+ * 
+ * probes: number of free blocks inspected
+ */
+static void count_probes(size_t probes)
+{
+#if MM_INSTRUMENT
+    arena->probes += probes;
+#endif
 }
 
 /*
- * find_fit: Look for free block in small_free_list if size is 16 bytes. 
- *           For larger size, start from free list of closest size class 
- *           and iterate through all free lists to get an appropriate one. 
- *           Return the found block or null
+ * count_fit: End the current fit search in an MM_INSTRUMENT build, and 
+ *            add it to the probe histogram
  * 
- * asize: The size that we need
+ * block: block found by the search, or null
  */
-static block_t *find_fit(size_t asize)
+static void count_fit(block_t *block)
 {
-    int i;
+#if MM_INSTRUMENT
+    struct mm_instrument *c = &arena->counters;
+    size_t probes = arena->probes;
+    int i = (probes == 0) ? 0 : 64 - __builtin_clzl(probes);
+
+    c->fit_searches++;
+    c->fit_misses += (block == NULL);
+    c->fit_probes += probes;
+    c->probe_hist[(i < MM_PROBE_BUCKETS) ? i : MM_PROBE_BUCKETS - 1]++;
+    arena->probes = 0;
+#endif
+}
 
-    // Use small block if asize fits
-    // Use free_list blocks if small_blocks_list is empty
-    if (asize <= dsize)
-    {
-        if (small_blocks_list != NULL)
-        {
-            return small_blocks_list;
-        }
-    }
+/*
+ * count_coalesce: Count a coalesce_block case in an MM_INSTRUMENT build
+ * 
+ * c: case number, 1 to 4
+ */
+static void count_coalesce(int c)
+{
+#if MM_INSTRUMENT
+    arena->counters.coalesce[c - 1]++;
+#endif
+}
 
-    // Find the starting size class
-    for (i = 0; i < FREE_LIST_SIZE; i ++)
+/*
+ * count_split: Count a split_block call in an MM_INSTRUMENT build
+ * 
+ * split: true if the block was split, false if it was left whole
+ */
+static void count_split(bool split)
+{
+#if MM_INSTRUMENT
+    if (split)
     {
-        if (i == FREE_LIST_SIZE -1)
-        {
-          break;      
-        } 
-        if ((asize >= (1L << (i + MIN_SIZE_CLASS))) 
-                && (asize < (1L << (i + (MIN_SIZE_CLASS + 1)))))
-        {
-            break;
-        }
-        
+        arena->counters.splits++;
     }
-    block_t *block;
-
-    // Look for 
-    for (; i < FREE_LIST_SIZE; i ++)
+    else
     {
-        block = free_list[i];
-        while (block != NULL)
-        {
-            size_t block_size = get_size(block);
-            if (block_size >= asize)
-            {
-                return block;
-            }
-
-            block = block->data.link.next;
-        }
-    
+        arena->counters.split_declined++;
     }
-
-    return NULL; // no fit found
+#endif
 }
 
 /*
@@ -955,7 +4472,7 @@ static block_t *find_fit(size_t asize)
 bool mm_checkheap(int line)
 {   
     // Check prologue is created with correct flags
-    word_t *prologue = find_prev_footer(heap_start);
+    word_t *prologue = find_prev_footer(arena->heap_start);
     bool is_free = (extract_alloc(*prologue) == false);
     bool has_size = (extract_size(*prologue) == true);
     bool is_small = (extract_prev_small(*prologue) == true);
@@ -968,20 +4485,26 @@ bool mm_checkheap(int line)
 
     block_t *block;
     int free_block_count = 0;
-    bool prev_free = !get_alloc(heap_start);
+    size_t class_blocks[MM_STATS_CLASSES] = {0};
+    size_t class_bytes[MM_STATS_CLASSES] = {0};
+    size_t class_max[MM_STATS_CLASSES] = {0};
+    bool prev_free = !get_alloc(arena->heap_start);
     bool prev_alloc = extract_alloc(*prologue);
     bool prev_small = false;
 
-    for (block = heap_start; get_size(block) > 0;
+    for (block = arena->heap_start; get_size(block) > 0;
                             block = find_next(block))
     {
         // Check header stores correct size
+        // Free blocks larger than 16 bytes also carry a footer
         size_t payload_size = get_payload_size(block);
-        if ((payload_size + wsize) != get_size(block))
+        size_t overhead = (get_alloc(block) || get_size(block) <= dsize)
+                            ? wsize : 2 * wsize;
+        if ((payload_size + overhead) != get_size(block))
         {
             dbg_printf("Size is inconsistent\n");
-            dbg_printf("get_size %zu != (payload %zu + header %zu)", 
-                    get_size(block), payload_size, wsize);
+            dbg_printf("get_size %zu != (payload %zu + overhead %zu)", 
+                    get_size(block), payload_size, overhead);
             return false;
         }
 
@@ -1029,16 +4552,59 @@ bool mm_checkheap(int line)
             return false;
         }
 
-        // increment if free block
-        if (!get_alloc(block)) 
+        // increment if free block, unless it is a small block that 
+        // can't be listed
+        if (!get_alloc(block) 
+                && (get_size(block) > dsize || small_linkable(block))) 
         {
             free_block_count += 1;
         }
 
+        if (!get_alloc(block))
+        {
+            int c = get_stats_class(get_size(block));
+            class_blocks[c] += 1;
+            class_bytes[c] += get_size(block);
+            class_max[c] = max(class_max[c], get_size(block));
+        }
+
         prev_free = get_alloc(block);
 
     }
 
+    // Check free block counters match the heap
+    int c;
+    for (c = 0; c < MM_STATS_CLASSES; c++)
+    {
+        if (class_blocks[c] != arena->class_blocks[c] 
+                || class_bytes[c] != arena->class_bytes[c])
+        {
+            dbg_printf("Free block counters of class %d are wrong\n", c);
+            dbg_printf("Expect %zu blocks %zu bytes get %zu blocks %zu bytes\n",
+                    class_blocks[c], class_bytes[c], 
+                    (size_t) arena->class_blocks[c], arena->class_bytes[c]);
+            return false;
+        }
+
+        // The class maximum is a bound that is reset when it empties
+        if (arena->class_max[c] < class_max[c] 
+                || (class_blocks[c] == 0) != (arena->class_max[c] == 0))
+        {
+            dbg_printf("Free block maximum of class %d is wrong\n", c);
+            dbg_printf("Expect at least %zu get %zu\n", 
+                    class_max[c], arena->class_max[c]);
+            return false;
+        }
+    }
+
+    // Check the cached maximum of the tree is its rightmost node
+    block_t *root = arena->free_list[tree_class];
+    if (arena->tree_max != ((root != NULL) ? tree_rightmost(root) : NULL))
+    {
+        dbg_printf("Cached tree maximum is not the rightmost node\n");
+        return false;
+    }
+
     // Check epilogue prev status is correct
     if (prev_alloc != extract_prev_alloc(block->header))
     {
@@ -1055,9 +4621,20 @@ bool mm_checkheap(int line)
     }
 
     // Check small_block_lists 
-    for (block = small_blocks_list; block != NULL; block = block->data.link.next)
+    block_t *small_prev = NULL;
+    for (block = arena->small_blocks_list; block != NULL; 
+                            block = small_from_offset(block->data.small.next))
     {   
         free_block_count -= 1;
+
+        // Check prev offset points back to previous list node
+        if (small_from_offset(block->data.small.prev) != small_prev)
+        {
+            dbg_printf("Small list prev offset not consistent\n");
+            return false;
+        }
+        small_prev = block;
+
         // All blocks have the same size
         if (get_size(block) != dsize)
         {
@@ -1086,7 +4663,26 @@ bool mm_checkheap(int line)
     int i;
     for (i = 0; i < FREE_LIST_SIZE; i ++)
     {
-        block_t *block = free_list[i];
+        // Check bitmap marks exactly the non-empty size classes
+        if (get_class_map(i) != (arena->free_list[i] != NULL))
+        {
+            dbg_printf("Free list bitmap wrong for size class %d\n", i);
+            return false;
+        }
+
+        block_t *block = arena->free_list[i];
+
+        // Visit the tree of the largest size class in order
+        if (i == tree_class && block != NULL)
+        {
+            if (block->data.node.parent != NULL)
+            {
+                dbg_printf("Tree root has a parent\n");
+                return false;
+            }
+            block = tree_min(block);
+        }
+
         while (block != NULL)
         {
             free_block_count -= 1;
@@ -1122,7 +4718,7 @@ bool mm_checkheap(int line)
             }
 
             // Check memory bound
-            if((void *)(mem_heap_lo()) > (void *)(block) || (void *)(mem_heap_hi()) < (void *)(block))
+            if((void *)(mem_region_lo(arena->region)) > (void *)(block) || (void *)(mem_region_hi(arena->region)) < (void *)(block))
             {
                 dbg_printf("Free block outside of boundary\n");
                 return false;
@@ -1130,20 +4726,33 @@ bool mm_checkheap(int line)
 
             // Check size class
             size_t bsize = get_size(block);
-            if (i == (FREE_LIST_SIZE -1)) 
+            if (get_size_class(bsize) != i)
+            {
+                dbg_printf("Free block in wrong size class\n");
+                dbg_printf("Block size = %zu in size class %d\n", bsize, i);
+                return false;
+            }
+
+            // Check tree links and ordering
+            if (i == tree_class)
             {
-                if (bsize < (1L << (i + 4)))
+                block_t *left = block->data.node.left;
+                block_t *right = block->data.node.right;
+                if ((left != NULL && left->data.node.parent != block)
+                    || (right != NULL && right->data.node.parent != block))
                 {
-                    dbg_printf("Free block in wrong size class\n");
-                    dbg_printf("Block size = %zu in largest size class %lu\n", bsize, (1L << (i +4)) );
+                    dbg_printf("Tree child and parent pointers not consistent\n");
                     return false;
                 }
-                
-            } else if ((bsize < (1L << (i + 4))) || (bsize >= (1L << (i + 5))))
-            {
-                dbg_printf("Free block in wrong size class\n");
-                dbg_printf("Block size = %zu in size class %lu\n", bsize, (1L << (i +4)) );
-                return false;
+
+                block_t *tree_succ = tree_next(block);
+                if (tree_succ != NULL && !tree_less(block, tree_succ))
+                {
+                    dbg_printf("Tree blocks out of order\n");
+                    return false;
+                }
+                block = tree_succ;
+                continue;
             }
 
             // Check pointer consistency
@@ -1164,6 +4773,98 @@ bool mm_checkheap(int line)
         }
     }
     
+    // Check slab pages with free slots
+    for (i = 0; SLAB_ALLOC && i < SLAB_CLASSES; i++)
+    {
+        slab_page_t *page_prev = NULL;
+        slab_page_t *page;
+        for (page = arena->slab_lists[i]; page != NULL; page = page->next)
+        {
+            block_t *page_block = payload_to_header(page);
+            if (((uintptr_t) page & (slab_page_size - 1)) != 0
+                    || !get_alloc(page_block) 
+                    || get_size(page_block) != slab_page_size
+                    || !slab_map_test(page))
+            {
+                dbg_printf("Slab page %p is not a valid page block\n", 
+                            (void *) page);
+                return false;
+            }
+
+            if (page->obj_size != (size_t) (i + 1) * dsize)
+            {
+                dbg_printf("Slab page in wrong class %d\n", i);
+                return false;
+            }
+
+            if (page->prev != page_prev)
+            {
+                dbg_printf("Slab page prev and next not consistent\n");
+                return false;
+            }
+            page_prev = page;
+
+            // Listed pages have a free slot, used counts the others
+            size_t slots = (slab_page_size - wsize - sizeof(slab_page_t)) 
+                            / page->obj_size;
+            if (slots > 64)
+            {
+                slots = 64;
+            }
+            size_t free_slots = __builtin_popcountl(page->free_map);
+            if (free_slots == 0 || (slots < 64 && (page->free_map >> slots) != 0)
+                    || page->used != slots - free_slots)
+            {
+                dbg_printf("Slab page free slots inconsistent\n");
+                return false;
+            }
+        }
+    }
+
+    // Every slab page has its bit set in the slab page bitmap
+    size_t marked_pages = 0;
+    for (i = 0; SLAB_ALLOC && i < SLAB_MAP_CHUNKS; i++)
+    {
+        size_t words = (slab_map_base << (i > 0 ? i - 1 : 0)) / 64;
+        size_t w;
+        for (w = 0; arena->slab_map[i] != NULL && w < words; w++)
+        {
+            marked_pages += __builtin_popcountl(arena->slab_map[i][w]);
+        }
+    }
+    if (SLAB_ALLOC && marked_pages != arena->slab_pages)
+    {
+        dbg_printf("Slab page bitmap marks %zu pages, %zu in use\n", 
+                    marked_pages, arena->slab_pages);
+        return false;
+    }
+
+#if QUICK_LISTS
+    // Check quick lists hold allocated blocks of their size
+    for (i = 0; i < QUICK_BINS; i++)
+    {
+        size_t count = 0;
+        for (block = arena->quick_lists[i]; block != NULL; 
+                                    block = block->data.link.next)
+        {
+            if (!get_alloc(block) 
+                    || get_size(block) != quick_min_size + (size_t) i * dsize)
+            {
+                dbg_printf("Quick list %d holds a wrong block %p\n", i, 
+                            (void *) block);
+                return false;
+            }
+            count++;
+        }
+
+        if (count != arena->quick_counts[i] || count > QUICK_COUNT)
+        {
+            dbg_printf("Quick list %d count inconsistent\n", i);
+            return false;
+        }
+    }
+#endif
+
     // Check free_list size + small_free_list = total free blocks in heap
     if (free_block_count != 0)
     {
@@ -1225,6 +4926,187 @@ static size_t round_up(size_t size, size_t n)
     return n * ((size + (n-1)) / n);
 }
 
+/*
+ * sort_pointers: Sort pointers by address with an introsort, which needs 
+ *                no memory, unlike qsort, which may call malloc. Blocks 
+ *                allocated together tend to be freed in address order, or
+ *                its reverse, which is checked for first.
+ * 
+ * ptrs: array of pointers
+ * n: number of pointers
+ */
+static void sort_pointers(void **ptrs, size_t n)
+{
+    size_t i, ascending = 0;
+    for (i = 1; i < n; i++)
+    {
+        ascending += (uintptr_t) ptrs[i - 1] <= (uintptr_t) ptrs[i];
+    }
+    if (ascending + 1 >= n)
+    {
+        return;
+    }
+    if (ascending == 0)
+    {
+        for (i = 0; i < n / 2; i++)
+        {
+            swap_pointers(ptrs, i, n - 1 - i);
+        }
+        return;
+    }
+
+    size_t depth = 0;
+    size_t m;
+    for (m = n; m > 1; m >>= 1)
+    {
+        depth += 2;
+    }
+    sort_range(ptrs, n, depth);
+}
+
+/*
+ * sort_range: Quicksort pointers with a median of three pivot, recursing 
+ *             into the shorter part. Short ranges are sorted by insertion,
+ *             and ranges left after depth partitions by heapsort.
+ * 
+ * ptrs: array of pointers
+ * n: number of pointers
+ * depth: partitions left before falling back to heapsort
+ */
+static void sort_range(void **ptrs, size_t n, size_t depth)
+{
+    size_t i, j;
+
+    while (n > sort_insertion_max)
+    {
+        if (depth-- == 0)
+        {
+            heap_sort(ptrs, n);
+            return;
+        }
+
+        // Order the first, middle and last pointer, the middle one is the
+        // pivot and the outer ones stop the scans
+        size_t mid = n / 2;
+        if ((uintptr_t) ptrs[mid] < (uintptr_t) ptrs[0])
+        {
+            swap_pointers(ptrs, mid, 0);
+        }
+        if ((uintptr_t) ptrs[n - 1] < (uintptr_t) ptrs[mid])
+        {
+            swap_pointers(ptrs, n - 1, mid);
+            if ((uintptr_t) ptrs[mid] < (uintptr_t) ptrs[0])
+            {
+                swap_pointers(ptrs, mid, 0);
+            }
+        }
+        uintptr_t pivot = (uintptr_t) ptrs[mid];
+
+        // Hoare partition into [0, j] <= pivot <= [j + 1, n), where j
+        // stays below n - 1 as the pivot is not the last pointer
+        i = 0;
+        j = n;
+        while (true)
+        {
+            while ((uintptr_t) ptrs[i] < pivot)
+            {
+                i++;
+            }
+            do
+            {
+                j--;
+            } while ((uintptr_t) ptrs[j] > pivot);
+            if (i >= j)
+            {
+                break;
+            }
+            swap_pointers(ptrs, i, j);
+            i++;
+        }
+
+        size_t left = j + 1;
+        if (left < n - left)
+        {
+            sort_range(ptrs, left, depth);
+            ptrs += left;
+            n -= left;
+        }
+        else
+        {
+            sort_range(ptrs + left, n - left, depth);
+            n = left;
+        }
+    }
+
+    for (i = 1; i < n; i++)
+    {
+        void *p = ptrs[i];
+        for (j = i; j > 0 && (uintptr_t) ptrs[j - 1] > (uintptr_t) p; j--)
+        {
+            ptrs[j] = ptrs[j - 1];
+        }
+        ptrs[j] = p;
+    }
+}
+
+/*
+ * heap_sort: Sort pointers by address with heapsort
+ * 
+ * ptrs: array of pointers
+ * n: number of pointers
+ */
+static void heap_sort(void **ptrs, size_t n)
+{
+    size_t i;
+    for (i = n / 2; i > 0; i--)
+    {
+        sift_down(ptrs, i - 1, n);
+    }
+    for (i = n; i > 1; i--)
+    {
+        swap_pointers(ptrs, 0, i - 1);
+        sift_down(ptrs, 0, i - 1);
+    }
+}
+
+/*
+ * sift_down: Move pointer i down the max-heap of the first n pointers 
+ *            until it is not below a child
+ * 
+ * ptrs: array of pointers
+ * i: index of the pointer to be moved
+ * n: number of pointers in the heap
+ */
+static void sift_down(void **ptrs, size_t i, size_t n)
+{
+    void *p = ptrs[i];
+    size_t child;
+    while ((child = 2 * i + 1) < n)
+    {
+        if (child + 1 < n && (uintptr_t) ptrs[child + 1] > (uintptr_t) ptrs[child])
+        {
+            child++;
+        }
+        if ((uintptr_t) ptrs[child] <= (uintptr_t) p)
+        {
+            break;
+        }
+        ptrs[i] = ptrs[child];
+        i = child;
+    }
+    ptrs[i] = p;
+}
+
+/*
+ * swap_pointers: Exchange pointers i and j
+ */
+static void swap_pointers(void **ptrs, size_t i, size_t j)
+{
+    void *p = ptrs[i];
+    ptrs[i] = ptrs[j];
+    ptrs[j] = p;
+}
+
 /*
  * pack: returns a header reflecting a specified size , its alloc status, 
  *       previous block's alloc status and previous block's small size status.
@@ -1287,7 +5169,7 @@ static size_t get_size(block_t *block)
  * 
  * block: find its payload size
  */
-static word_t get_payload_size(block_t *block)
+static size_t get_payload_size(block_t *block)
 {
     size_t asize = get_size(block);
 
@@ -1298,7 +5180,7 @@ static word_t get_payload_size(block_t *block)
     }
     
     // Small free block has no footer
-    return asize <= dsize ? asize - wsize : asize - dsize;
+    return asize <= dsize ? asize - wsize : asize - 2 * wsize;
 }
 
 /*
@@ -1482,6 +5364,51 @@ static block_t *find_prev(block_t *block)
 }
 
 
+/*
+ * small_linkable: returns true when a small block is close enough to 
+ *                 heap_start for its offset to fit in 32 bits.
+ * 
+ * block: small block to be linked
+ */
+static bool small_linkable(block_t *block)
+{
+    size_t units = ((char *) block - (char *) arena->heap_start) / dsize;
+    return units < UINT32_MAX;
+}
+
+
+/*
+ * small_to_offset: returns the small list offset of a block, counted in
+ *                  16-byte units from heap_start plus one. NULL is 0.
+ * 
+ * block: small block, or NULL
+ */
+static uint32_t small_to_offset(block_t *block)
+{
+    if (block == NULL)
+    {
+        return 0;
+    }
+    return (uint32_t) (((char *) block - (char *) arena->heap_start) / dsize + 1);
+}
+
+
+/*
+ * small_from_offset: returns the small block at a small list offset,
+ *                    or NULL if offset is 0.
+ * 
+ * offset: offset created by small_to_offset
+ */
+static block_t *small_from_offset(uint32_t offset)
+{
+    if (offset == 0)
+    {
+        return NULL;
+    }
+    return (block_t *) ((char *) arena->heap_start + (size_t) (offset - 1) * dsize);
+}
+
+
 /*
  * payload_to_header: given a payload pointer, returns a pointer to the
  *                    corresponding block.
@@ -1514,5 +5441,5 @@ static void *header_to_payload(block_t *block)
  */
 static word_t *header_to_footer(block_t *block)
 {
-    return (word_t *) (block->data.payload + get_size(block) - dsize);
+    return (word_t *) (block->data.payload + get_size(block) - 2 * wsize);
 }
@@ -8,6 +8,9 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
 
 #else
 
@@ -16,10 +19,91 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
 
 #endif
 
 extern bool mm_init(void);
 
+/* Allocate up to n blocks of size bytes into ptrs.  Returns the number 
+ * allocated */
+extern size_t mm_malloc_batch(size_t size, void **ptrs, size_t n);
+
+/* Free n blocks, skipping null pointers.  Reorders ptrs */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* Free or resize a block, given the size it was last requested with */
+extern void mm_free_sized(void *ptr, size_t size);
+extern void *mm_realloc_sized(void *ptr, size_t old_size, size_t size);
+
+/* Number of bytes the block of ptr can hold */
+extern size_t mm_usable_size(void *ptr);
+
+/* Resize a block without moving it.  Returns false if it can't */
+extern bool mm_try_expand(void *ptr, size_t size);
+
+/* Search policies of the allocator's fit search */
+#define MM_FIT_FIRST 0
+#define MM_FIT_BEST_CLASS 1
+#define MM_FIT_BEST_OF_N 2
+
+/* Select the fit search policy.  Returns false if policy is unknown */
+extern bool mm_set_fit_policy(int policy);
+
+/* Set the trailing free block size above which free shrinks the heap.
+ * 0 disables trimming */
+extern void mm_set_trim_threshold(size_t threshold);
+
+/* Set the request size from which blocks get a mapping of their own.
+ * 0 keeps all blocks in the heap */
+extern void mm_set_mmap_threshold(size_t threshold);
+
+/* Number of size classes of struct mm_stats.  Class i counts free blocks
+ * of 2^(i+4) to 2^(i+5)-1 bytes, the last class all larger ones */
+#define MM_STATS_CLASSES 13
+
+/* Snapshot of the heap, summed over all arenas */
+struct mm_stats {
+    size_t heap_size;                       /* Bytes in the heaps */
+    size_t free_bytes;                      /* Bytes in free blocks */
+    size_t free_blocks;                     /* Number of free blocks */
+    size_t largest_free;                    /* Size of the largest free block */
+    size_t wilderness;                      /* Size of the free blocks ending the heaps */
+    size_t quick_bytes;                     /* Bytes in quick list blocks */
+    size_t quick_blocks;                    /* Number of quick list blocks */
+    size_t slab_pages;                      /* Number of slab pages */
+    size_t class_bytes[MM_STATS_CLASSES];   /* Bytes in free blocks per class */
+    size_t class_blocks[MM_STATS_CLASSES];  /* Number of free blocks per class */
+};
+
+/* Fill stats with a snapshot of the heap, without walking the heap */
+extern void mm_get_stats(struct mm_stats *stats);
+
+/* Number of probe histogram buckets of struct mm_instrument.  Bucket 0
+ * counts searches inspecting no block, bucket i > 0 searches inspecting
+ * 2^(i-1) to 2^i-1 blocks, the last bucket all longer ones */
+#define MM_PROBE_BUCKETS 8
+
+/* Hot path counters of a build with MM_INSTRUMENT=1, summed over all
+ * arenas since mm_init */
+struct mm_instrument {
+    size_t fit_searches;                    /* Fit searches */
+    size_t fit_misses;                      /* Searches finding no block */
+    size_t fit_probes;                      /* Free blocks inspected */
+    size_t probe_hist[MM_PROBE_BUCKETS];    /* Searches by blocks inspected */
+    size_t coalesce[4];                     /* Frees with neither, the next,
+                                               the previous or both
+                                               neighbors free */
+    size_t splits;                          /* Blocks split on allocation */
+    size_t split_declined;                  /* Blocks left whole, too small
+                                               to split */
+};
+
+/* Fill counters with the hot path counters.  Returns false, with counters
+ * cleared, if the allocator was built without MM_INSTRUMENT */
+extern bool mm_get_instrument(struct mm_instrument *counters);
+
 /* This is for debugging.  Returns false if error encountered */
 extern bool mm_checkheap(int lineno);